@@ -30,412 +30,383 @@ print_usage(void) {
   fprintf(stderr, "$ %s <dssi_plugin.so>[%c<label>]\n", my_name, LABEL_SEP);
   fprintf(stderr, "  [-p [<bank>%c]<preset>] "
 	  "(use -p -1 for default port values;\n           "
-	  "-p -2 for random values; omit -p to read port values from stdin)\n",
-	  BANK_SEP);
-  fprintf(stderr, "  [-l <length>] (in seconds, between note-on and note-off; default is 1s)\n");
+	  "-p -2 for random values; omit -p to read port values from stdin;\n           "
+	  "-p [<bank>%c]all renders every program, writing <output_file>-<bank>-<program>-<name>.wav)\n",
+	  BANK_SEP, BANK_SEP);
+  fprintf(stderr, "  [-s <seed>] (seed for -p -2 and -N; default is taken from the clock)\n");
+  fprintf(stderr, "  [-N [<first>%c]<count>] (render random patches first .. first+count-1,\n           "
+	  "writing <output_file>-<patch>.wav and .prs)\n", BANK_SEP);
+  fprintf(stderr, "  [-j <threads>] (worker threads for -N and -p all; use -j 0 for one per CPU)\n");
+  fprintf(stderr, "  [-A] (pin the -j workers to CPUs spread over the NUMA nodes, keep each one's\n           "
+	  "memory on its own node, and report throughput per node; needs libnuma)\n");
+  fprintf(stderr, "  [-l <length>] (in seconds, between note-on and note-off; default is 1s,\n           or the length of the -i input)\n");
   fprintf(stderr, "  [-r <release_tail>] (in seconds: amount of data to allow after note-off;\n           default waits until silence (up to a maximum of 15s))\n");
+  fprintf(stderr, "  [-i <input_file>] (audio for the plugin's audio inputs; \"-\" for stdin;\n           "
+	  "*.raw is interleaved native floats, one channel per input)\n");
   fprintf(stderr, "  [-f <output_file.wav>] (default == \"output.wav\")\n");
+  fprintf(stderr, "  [-x <output_file.wav>%c<matrix>] ... (also write a file mixed from the plugin's\n           "
+	  "outputs: one row of gains per channel, '%c' between gains, '%c' between rows,\n           "
+	  "eg 1%c0%c0%c1 for stereo from the first two outputs)\n",
+	  KEYVAL_SEP, COL_SEP, ROW_SEP, COL_SEP, ROW_SEP, COL_SEP);
+  fprintf(stderr, "  [-w <buffers>] (write the output on a separate thread, through a pool of\n           <buffers> buffers of %d frames)\n", WRITER_BUFFER_FRAMES);
   fprintf(stderr, "  [-c <no_channels>] (default == 1; use -c -1 to use plugin's channel count)\n");
   fprintf(stderr, "  [-n <midi_note_no>] (default == 60)\n");
   fprintf(stderr, "  [-v <midi_velocity>] (default == 127)\n");
   fprintf(stderr, "  [-d <project_directory>]\n");
   fprintf(stderr, "  [-k <configure_key>%c<value>] ...\n", KEYVAL_SEP);
   fprintf(stderr, "  [-b] (clip out-of-bounds values, including Inf and NaN, to within bounds\n       (calls exit()) if -b is omitted)\n");
+  fprintf(stderr, "  [-z] (flush denormals to zero while running the plugin)\n");
+  fprintf(stderr, "  [-T] (time each block and report blocks that look denormal-bound,\n       the overall rendering speed and the host's heap allocations)\n");
+  fprintf(stderr, "  [--describe] (print the plugins' ports, defaults and programs as JSON,\n           and exit)\n");
   exit(1);
 }
-  
-int
-main(int argc, char **argv) {
-
-  my_name = basename(argv[0]);
-
-  DSSI_Descriptor_Function descfn;
-  const DSSI_Descriptor *descriptor;
-  LADSPA_Handle instanceHandle;
-  void *pluginObject;
-
-  SNDFILE *outfile;
-  SF_INFO outsfinfo;
-
-  char **configure_key = NULL;
-  char **configure_val = NULL;
-  char *directory = NULL;
-  char *dllName = NULL;
-  char *label;
-  char *output_file = "output.wav";
-  char *projectDirectory = NULL;
 
+/* Instantiate the plugin and connect its ports to new buffers.
+ * Returns NULL if the plugin won't instantiate. */
+instance_t *
+create_instance(const DSSI_Descriptor *descriptor, size_t nframes) {
+  instance_t *inst = host_alloc(sizeof(instance_t));
   int in, out, controlIn, controlOut;
-  int ins, outs, controlIns, controlOuts;
-  port_vals_source_t src = from_stdin;
-  int nchannels = 1;
-  int midi_velocity = 127;
-  int midi_note = 60;
-  int bank = 0;
-  int program_no = 0;
-  int nkeys = 0;
-  int clip = 0;
-  int have_warned = 0;
-
-
-  size_t length = SAMPLE_RATE;
-  size_t release_tail = -1;
-  size_t nframes = 256;
-  size_t total_written = 0;
-  size_t items_written = 0;
-  
-  float **pluginInputBuffers, **pluginOutputBuffers;
-  float *pluginControlIns, *pluginControlOuts;
-
-  sample_rate = SAMPLE_RATE;
-  
-  /* Probably an unorthodox srandom() technique... */
-  struct timeval tv;
-  struct timezone tz;
-  gettimeofday(&tv, &tz);
-  srandom(tv.tv_sec + tv.tv_usec);
-
-  if (argc < 2) {
-    print_usage();
-  }
-
-  /* dll name is argv[1]: parse dll name, plus a label if supplied */
-  parse_keyval(argv[1], LABEL_SEP, &dllName, &label);
-
-  for (int i = 2; i < argc; i++) {
-    if (DEBUG) {
-      fprintf(stderr, "%s: processing options: argv[%d] = %s\n", 
-	      my_name, i, argv[i]);
-    }
-
-    /* Deal with flags */
-    if (!strcmp(argv[i], "-b")) {
-      clip = 1;
-      continue;
-    } else {
-      /* It's not a flag, so expect option + argument */
-      if (argc <= i + 1) print_usage();
-    }
-
-    if (!strcmp(argv[i], "-c")) {
-      nchannels = strtol(argv[++i], NULL, 0);
-    } else if (!strcmp(argv[i], "-f")) {
-      output_file = argv[++i];
-    } else if (!strcmp(argv[i], "-n")) {
-      midi_note = strtol(argv[++i], NULL, 0);
-    } else if (!strcmp(argv[i], "-v")) {
-      midi_velocity = strtol(argv[++i], NULL, 0);
-    } else if (!strcmp(argv[i], "-d")) {
-      projectDirectory = argv[++i];
-    } else if (!strcmp(argv[i], "-l")) {
-      length = sample_rate * strtof(argv[++i], NULL);
-    } else if (!strcmp(argv[i], "-r")) {
-      release_tail = sample_rate * strtof(argv[++i], NULL);
-    } else if (!strcmp(argv[i], "-k")) {
-      configure_key = realloc(configure_key, (nkeys + 1) * sizeof(char *));
-      configure_val = realloc(configure_val, (nkeys + 1) * sizeof(char *));
-      parse_keyval(argv[++i], KEYVAL_SEP, &configure_key[nkeys], 
-		   &configure_val[nkeys]);
-      nkeys++;
-      
-    } else if (!strcmp(argv[i], "-p")) {
-      char *first_str;
-      char *second_str;
-      parse_keyval(argv[++i], BANK_SEP, &first_str, &second_str);
-      if (second_str) {
-	bank = strtol(first_str, NULL, 0);
-	program_no = strtol(second_str, NULL, 0);
-      } else {
-	program_no = strtol(first_str, NULL, 0);
-	bank = 0;
-      }
-      if (program_no == -1) {
-	src = from_defaults;
-      } else if (program_no == -2) {
-	src = from_random;
-      } else {
-	src = from_preset;
-      }
-    } else {
-      fprintf(stderr, "%s: Error: Unknown option: %s\n", my_name, argv[i]);
-      print_usage();
-    }
-  }
-
-  if (DEBUG) {
-    for (int i = 0; i < nkeys; i++) {
-      printf("key %d: %s; value: %s\n", i, configure_key[i],
-	     configure_val[i]);
-    }
-  }
-
-  if (DEBUG) {
-    fprintf(stderr, "%s: Cmd-line args ok\n", my_name);
-  }
-
-  directory = load(dllName, &pluginObject, 0);
-  if (!directory || !pluginObject) {
-    fprintf(stderr, "\n%s: Error: Failed to load plugin library \"%s\"\n", 
-	    my_name, dllName);
-    return 1;
-  }
-                
-  descfn = (DSSI_Descriptor_Function)dlsym(pluginObject, 
-					   "dssi_descriptor");
-
-  if (!descfn) {
-    fprintf(stderr, "%s: Error: Not a DSSI plugin\n", my_name);
-    exit(1);
-  }
-
-
-  /* Get the plugin descriptor and check the run_synth*() function
-   * exists */
-  int j = 0;
-  descriptor = NULL;
-  const DSSI_Descriptor *desc;
-	
-  while ((desc = descfn(j++))) {
-    if (!label ||
-	!strcmp(desc->LADSPA_Plugin->Label, label)) {
-      descriptor = desc;
-      break;
-    }
-  }
-
-  if (!descriptor) {
-    fprintf(stderr, 
-	    "\n%s: Error: Plugin label \"%s\" not found in library \"%s\"\n",
-	    my_name, label ? label : "(none)", dllName);
-    return 1;
-  }
-
-  if (!descriptor->run_synth 
-      && !descriptor->run_multiple_synths) {
-    fprintf(stderr, "%s: Error: No run_synth() or run_multiple_synths() method in plugin\n", my_name);
-    exit(1);
-  }
 
-  if (!label) {
-    label = strdup(descriptor->LADSPA_Plugin->Label);
-  }
+  memset(inst, 0, sizeof(instance_t));
+  inst->descriptor = descriptor;
 
   /* Count number of i/o buffers and ports required */
-  ins = 0;
-  outs = 0;
-  controlIns = 0;
-  controlOuts = 0;
- 
   for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {
     LADSPA_PortDescriptor pod =
       descriptor->LADSPA_Plugin->PortDescriptors[j];
 
     if (LADSPA_IS_PORT_AUDIO(pod)) {
-	    
-      if (LADSPA_IS_PORT_INPUT(pod)) ++ins;
-      else if (LADSPA_IS_PORT_OUTPUT(pod)) ++outs;
-	    
+
+      if (LADSPA_IS_PORT_INPUT(pod)) ++inst->ins;
+      else if (LADSPA_IS_PORT_OUTPUT(pod)) ++inst->outs;
+
     } else if (LADSPA_IS_PORT_CONTROL(pod)) {
-	    
-      if (LADSPA_IS_PORT_INPUT(pod)) ++controlIns;
-      else if (LADSPA_IS_PORT_OUTPUT(pod)) ++controlOuts;
+
+      if (LADSPA_IS_PORT_INPUT(pod)) ++inst->controlIns;
+      else if (LADSPA_IS_PORT_OUTPUT(pod)) ++inst->controlOuts;
     }
   }
 
-  if (!outs) {
-    fprintf(stderr, "%s: Error: no audio output ports\n", my_name);
-    exit(1);
+  /* Create buffers, all in one block and each on its own cache lines */
+
+  arena_init(&inst->arena,
+	     arena_round(inst->ins * sizeof(float *)) +
+	     arena_round(inst->outs * sizeof(float *)) +
+	     arena_round(inst->controlIns * sizeof(float)) +
+	     arena_round(inst->controlOuts * sizeof(float)) +
+	     (inst->ins + inst->outs) * arena_round(nframes * sizeof(float)));
+  arena_init(&inst->job_arena, JOB_ARENA_BYTES);
+
+  inst->pluginInputBuffers = arena_alloc(&inst->arena,
+					 inst->ins * sizeof(float *));
+  inst->pluginControlIns = arena_alloc(&inst->arena,
+				       inst->controlIns * sizeof(float));
+
+  inst->pluginOutputBuffers = arena_alloc(&inst->arena,
+					  inst->outs * sizeof(float *));
+  inst->pluginControlOuts = arena_alloc(&inst->arena,
+					inst->controlOuts * sizeof(float));
+
+  /* Audio inputs get silence unless there's an input file */
+  for (int i = 0; i < inst->ins; i++) {
+    inst->pluginInputBuffers[i] = arena_alloc(&inst->arena,
+					      nframes * sizeof(float));
   }
-  if (nchannels == -1) {
-    nchannels = outs;
-  }
-
-  /* Create buffers */
-
-  pluginInputBuffers = (float **)malloc(ins * sizeof(float *));
-  pluginControlIns = (float *)calloc(controlIns, sizeof(float));
-
-  pluginOutputBuffers = (float **)malloc(outs * sizeof(float *));
-  pluginControlOuts = (float *)calloc(controlOuts, sizeof(float));
-
-  for (int i = 0; i < outs; i++) {
-    pluginOutputBuffers[i] = (float *)calloc(nframes, sizeof(float));
+  for (int i = 0; i < inst->outs; i++) {
+    inst->pluginOutputBuffers[i] = arena_alloc(&inst->arena,
+					       nframes * sizeof(float));
   }
 
-
-
   /* Instantiate plugin */
 
-  instanceHandle = descriptor->LADSPA_Plugin->instantiate
+  inst->handle = descriptor->LADSPA_Plugin->instantiate
     (descriptor->LADSPA_Plugin, sample_rate);
-  if (!instanceHandle) {
-    fprintf(stderr, 
-	    "\n%s: Error: Failed to instantiate instance %d!, plugin \"%s\"\n",
-	    my_name, 0, label);
-    return 1;
+  if (!inst->handle) {
+    arena_free(&inst->arena);
+    free(inst);
+    return NULL;
   }
 
   /* Connect ports */
 
   in = out = controlIn = controlOut = 0;
-  for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {  
+  for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {
     /* j is LADSPA port number */
-    
+
     LADSPA_PortDescriptor pod =
       descriptor->LADSPA_Plugin->PortDescriptors[j];
-    
+
     if (LADSPA_IS_PORT_AUDIO(pod)) {
-      
+
       if (LADSPA_IS_PORT_INPUT(pod)) {
 	descriptor->LADSPA_Plugin->connect_port
-	  (instanceHandle, j, pluginInputBuffers[in++]);
-	
+	  (inst->handle, j, inst->pluginInputBuffers[in++]);
+
       } else if (LADSPA_IS_PORT_OUTPUT(pod)) {
 	descriptor->LADSPA_Plugin->connect_port
-	  (instanceHandle, j, pluginOutputBuffers[out++]);
+	  (inst->handle, j, inst->pluginOutputBuffers[out++]);
       }
-      
+
     } else if (LADSPA_IS_PORT_CONTROL(pod)) {
-      
+
       if (LADSPA_IS_PORT_INPUT(pod)) {
-	
+
 	descriptor->LADSPA_Plugin->connect_port
-	  (instanceHandle, j, &pluginControlIns[controlIn++]);
-	
+	  (inst->handle, j, &inst->pluginControlIns[controlIn++]);
+
       } else if (LADSPA_IS_PORT_OUTPUT(pod)) {
 	descriptor->LADSPA_Plugin->connect_port
-	  (instanceHandle, j, &pluginControlOuts[controlOut++]);
+	  (inst->handle, j, &inst->pluginControlOuts[controlOut++]);
       }
     }
   }  /* 'for (j...'  LADSPA port number */
 
+  return inst;
+}
 
+void
+free_instance(instance_t *inst) {
+  if (inst->descriptor->LADSPA_Plugin->cleanup) {
+    inst->descriptor->LADSPA_Plugin->cleanup(inst->handle);
+  }
+  if (inst->output) {
+    for (int f = 0; f < inst->noutputs; f++) {
+      output_destroy(&inst->output[f]);
+    }
+  }
+  input_destroy(&inst->input);
+  arena_free(&inst->arena);
+  arena_free(&inst->job_arena);
+  free(inst->block_stats.seconds);
+  free(inst->block_stats.denormals);
+  free(inst->block_stats.peak);
+  free(inst->block_stats.sorted);
+  free(inst);
+}
 
-  /* Set the control port values */
+/* Set the control port values: from a preset, defaults, random (patch
+ * number 'patch' of the sequence for 'seed') or from stdin */
+void
+set_control_ins(instance_t *inst, port_vals_source_t src,
+		int bank, int program_no, uint64_t seed, uint64_t patch) {
+  const DSSI_Descriptor *descriptor = inst->descriptor;
+  int controlIn;
 
   if (src == from_preset) {
     /* Set the ports according to a preset */
     if (descriptor->select_program) {
-      descriptor->select_program(instanceHandle, bank, program_no);
+      /* Start from the same state as a new instance, so that ports
+       * the program doesn't set get repaired in the same way */
+      memset(inst->pluginControlIns, 0, inst->controlIns * sizeof(float));
+      descriptor->select_program(inst->handle, bank, program_no);
     }
   } else {
     /* Assign values to control ports: defaults, random, or from stdin */
     controlIn = 0;
-    for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {  
+    for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {
       /* j is LADSPA port number */
-      
+
       LADSPA_PortDescriptor pod =
 	descriptor->LADSPA_Plugin->PortDescriptors[j];
-      
+
       if (LADSPA_IS_PORT_CONTROL(pod) && LADSPA_IS_PORT_INPUT(pod)) {
-	LADSPA_Data val;
+	LADSPA_Data val = 0.0f;
 	if (src == from_defaults) {
 	  val = get_port_default(descriptor->LADSPA_Plugin, j);
 	} else if (src == from_stdin) {
 	  scanf("%f", &val);
 	} else if (src == from_random) {
-	  val = get_port_random(descriptor->LADSPA_Plugin, j);
+	  val = get_port_random(descriptor->LADSPA_Plugin, j, seed, patch);
 	}
-	pluginControlIns[controlIn] = val;
+	inst->pluginControlIns[controlIn] = val;
 	controlIn++;
       }
     }
   }
-	
+}
 
-  /* It can happen that a control port is set wrongly after
-   * select_program(): for example xsynth-dssi does not set its tuning
-   * port in the select_program() call (which makes sense: xsynth
-   * users might want to be able to keep their current tuning while
-   * changing presets).  Here, if we call select_program() we'll get
-   * tuning = 0.0, and we don't get any sound. There might be other
-   * bad effects in other cases.  One solution is to read all the
-   * control-in values and if they're not in range, reset them using
-   * get_default().
-   */
+/* It can happen that a control port is set wrongly after
+ * select_program(): for example xsynth-dssi does not set its tuning
+ * port in the select_program() call (which makes sense: xsynth
+ * users might want to be able to keep their current tuning while
+ * changing presets).  Here, if we call select_program() we'll get
+ * tuning = 0.0, and we don't get any sound. There might be other
+ * bad effects in other cases.  One solution is to read all the
+ * control-in values and if they're not in range, reset them using
+ * get_default().
+ */
+void
+repair_control_ins(instance_t *inst) {
+  const DSSI_Descriptor *descriptor = inst->descriptor;
+  int controlIn = 0;
 
-  controlIn = 0;
-  for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {  
+  for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {
     /* j is LADSPA port number */
-      
+
     LADSPA_PortDescriptor pod =
       descriptor->LADSPA_Plugin->PortDescriptors[j];
-    
+
     if (LADSPA_IS_PORT_CONTROL(pod) && LADSPA_IS_PORT_INPUT(pod)) {
 
       LADSPA_PortRangeHintDescriptor prhd =
-	descriptor->LADSPA_Plugin->PortRangeHints[j].HintDescriptor;      
+	descriptor->LADSPA_Plugin->PortRangeHints[j].HintDescriptor;
       const char * pname = descriptor->LADSPA_Plugin->PortNames[j];
+      /* (bounds in the same units as get_port_default() and
+       * get_port_random() use) */
+      float scale = LADSPA_IS_HINT_SAMPLE_RATE(prhd) ? sample_rate : 1.0f;
       LADSPA_Data lb = descriptor->LADSPA_Plugin->
-	PortRangeHints[j].LowerBound;
+	PortRangeHints[j].LowerBound * scale;
       LADSPA_Data ub = descriptor->LADSPA_Plugin->
-	PortRangeHints[j].UpperBound;
-      LADSPA_Data val = pluginControlIns[controlIn];
+	PortRangeHints[j].UpperBound * scale;
+      LADSPA_Data val = inst->pluginControlIns[controlIn];
       LADSPA_Data def = get_port_default(descriptor->LADSPA_Plugin, j);
 
       if ((LADSPA_IS_HINT_BOUNDED_BELOW(prhd) && val < lb) ||
 	  (LADSPA_IS_HINT_BOUNDED_ABOVE(prhd) && val > ub)) {
-	fprintf(stderr, 
+	fprintf(stderr,
 		"%s: Warning: port %d (%s) was %.3f, overriding to %.3f\n",
 		my_name, j, pname, val, def);
-	pluginControlIns[controlIn] = def;
+	inst->pluginControlIns[controlIn] = def;
       }
       if (DEBUG) {
-	fprintf(stderr, 
+	fprintf(stderr,
 		"port %3d; prhd %3d; lb %6.2f; ub %6.2f; val %6.2f (%s)\n",
 		j, prhd, lb, ub, val, pname);
       }
       controlIn++;
     }
   }
+}
 
-  /* Activate */
-
-  if (descriptor->LADSPA_Plugin->activate) {
-    descriptor->LADSPA_Plugin->activate(instanceHandle);
-  }
-
-
-  /* Configure */
+void
+configure_instance(instance_t *inst, const render_opts_t *opts) {
+  const DSSI_Descriptor *descriptor = inst->descriptor;
 
-  if (projectDirectory && descriptor->configure) {
-    char *rv = descriptor->configure(instanceHandle,
+  if (opts->projectDirectory && descriptor->configure) {
+    char *rv = descriptor->configure(inst->handle,
 				     DSSI_PROJECT_DIRECTORY_KEY,
-				     projectDirectory);
+				     opts->projectDirectory);
     if (rv) {
-      fprintf(stderr, 
+      fprintf(stderr,
 	      "%s: Warning: plugin doesn't like project directory: \"%s\"\n",
 	      my_name, rv);
     }
   }
-  if (nkeys && descriptor->configure) {
-    for (int i = 0; i < nkeys; i++) {
-      char *rv = descriptor->configure(instanceHandle,
-				       configure_key[i],
-				       configure_val[i]);
+  if (opts->nkeys && descriptor->configure) {
+    for (int i = 0; i < opts->nkeys; i++) {
+      char *rv = descriptor->configure(inst->handle,
+				       opts->configure_key[i],
+				       opts->configure_val[i]);
       if (rv) {
-	fprintf(stderr, 
+	fprintf(stderr,
 		"%s: Warning: plugin doesn't like "
-		"configure key-value pair: \"%s\"\n", 
+		"configure key-value pair: \"%s\"\n",
 		my_name, rv);
       }
     }
   }
+}
 
+/* Activate the instance, send an on-event, wait, send an off-event,
+ * wait for release tail to die, and deactivate, writing everything to
+ * the output files (with "-<tag>" added to their names, if tag isn't
+ * NULL). The control ports must be set already. Returns 0 on
+ * success. */
+int
+render(instance_t *inst, const render_opts_t *opts, const char *tag) {
+  const DSSI_Descriptor *descriptor = inst->descriptor;
+  LADSPA_Handle instanceHandle = inst->handle;
+  float **pluginOutputBuffers = inst->pluginOutputBuffers;
+  int outs = inst->outs;
+  int noutputs = opts->noutputs;
+  size_t nframes = opts->nframes;
+  size_t length = opts->length;
+  size_t release_tail = opts->release_tail;
+
+  char output_file[noutputs][PATH_MAX];
+  SNDFILE *outfile[noutputs];
+  SF_INFO outsfinfo;
+  output_t *output;
+  int nopen = 0;
+  input_t *input = &inst->input;
+  int have_input = opts->input_file && inst->ins;
+  int input_done = !have_input;
+  size_t input_end = 0;         /* frames of input, once input_done */
+
+  size_t total_written = 0;
+  int have_warned = 0;
+  int status = 0;
+  double render_start = 0.0;
+  size_t allocations_at_start = heap_allocations;
+  size_t allocations_in_loop = 0;
+
+  /* Everything render() needs for this note comes from the job arena,
+   * which is kept from one render to the next. The outputs (and their
+   * writer threads) are kept with the instance, which always renders
+   * with the same opts. */
+  arena_reset(&inst->job_arena);
+  if (!inst->output) {
+    inst->output = arena_alloc(&inst->arena, noutputs * sizeof(output_t));
+    inst->noutputs = noutputs;
+  }
+  output = inst->output;
 
-  /* Open sndfile */
+  /* Activate */
 
-  outsfinfo.samplerate = sample_rate;
-  outsfinfo.channels = nchannels;
-  outsfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
-  outsfinfo.frames = length;
-    
-  outfile = sf_open(output_file, SFM_WRITE, &outsfinfo);
-  if (!outfile) {
-    fprintf(stderr, "%s: Error: Not able to open output file %s.\n", 
-	    my_name, output_file);
-    fprintf(stderr, "%s: %s\n", my_name, sf_strerror(outfile));
-    return 1;
+  if (descriptor->LADSPA_Plugin->activate) {
+    descriptor->LADSPA_Plugin->activate(instanceHandle);
+  }
+
+  /* Configure (once per instance: the plugin keeps its configuration
+   * across deactivate()/activate()) */
+
+  if (!inst->configured) {
+    configure_instance(inst, opts);
+    inst->configured = 1;
+  }
+
+
+  /* Open sndfiles */
+
+  for (int f = 0; f < noutputs; f++) {
+    const output_spec_t *spec = &opts->outputs[f];
+
+    if (tag) {
+      make_output_name(output_file[f], PATH_MAX, spec->file, tag, NULL);
+    } else {
+      snprintf(output_file[f], PATH_MAX, "%s", spec->file);
+    }
+
+    outsfinfo.samplerate = sample_rate;
+    outsfinfo.channels = spec->routing.nchannels;
+    outsfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+    outsfinfo.frames = length;
+
+    outfile[f] = sf_open(output_file[f], SFM_WRITE, &outsfinfo);
+    if (!outfile[f]) {
+      fprintf(stderr, "%s: Error: Not able to open output file %s.\n",
+	      my_name, output_file[f]);
+      fprintf(stderr, "%s: %s\n", my_name, sf_strerror(outfile[f]));
+      status = 1;
+      goto done;
+    }
+
+    output_open(&output[f], &inst->job_arena, outfile[f],
+		spec->routing.nchannels, nframes, opts->nbuffers);
+    nopen++;
+  }
+
+
+  /* Open the input, if any. Without -l, the note-off goes at the end
+   * of the input. */
+
+  if (have_input) {
+    if (input_open(input, &inst->job_arena, opts->input_file, inst->ins)) {
+      have_input = 0;
+      status = 1;
+      goto done;
+    }
   }
 
 
@@ -445,19 +416,24 @@ main(int argc, char **argv) {
   snd_seq_event_t on_event, off_event, *current_event;
   on_event.type = SND_SEQ_EVENT_NOTEON;
   on_event.data.note.channel = 0;
-  on_event.data.note.note = midi_note;
-  on_event.data.note.velocity = midi_velocity;
+  on_event.data.note.note = opts->midi_note;
+  on_event.data.note.velocity = opts->midi_velocity;
   on_event.time.tick = 0;
 
   off_event.type = SND_SEQ_EVENT_NOTEOFF;
   off_event.data.note.channel = 0;
-  off_event.data.note.note = midi_note;
-  off_event.data.note.off_velocity = midi_velocity;
+  off_event.data.note.note = opts->midi_note;
+  off_event.data.note.off_velocity = opts->midi_velocity;
   off_event.time.tick = 0;
 
-  /* Generate the data: send an on-event, wait, send an off-event, 
+  inst->block_stats.nblocks = 0;
+  if (opts->time_blocks) {
+    render_start = get_time();
+  }
+  allocations_in_loop = heap_allocations;
+
+  /* Generate the data: send an on-event, wait, send an off-event,
      wait for release tail to die */
-  total_written = 0;
   int finished = 0;
   unsigned long nevents;
   while (!finished) {
@@ -476,6 +452,21 @@ main(int argc, char **argv) {
 /*       fprintf(stderr, "about to call run_synth() or run_multiple_synths() with %ld events\n", nevents); */
 /*     } */
 
+    if (have_input) {
+      /* (after the end, this just clears the buffers) */
+      size_t got = input_read(input, inst->pluginInputBuffers, inst->ins,
+			      nframes);
+      if (got < nframes && !input_done) {
+	input_done = 1;
+	input_end = total_written + got;
+	if (length == (size_t) -1) {
+	  length = total_written + nframes;
+	}
+      }
+    }
+
+    double block_start = opts->time_blocks ? get_time() : 0.0;
+
     if (descriptor->run_synth) {
       descriptor->run_synth(instanceHandle,
 			    nframes,
@@ -489,121 +480,988 @@ main(int argc, char **argv) {
 				      &nevents);
     }
 
-    /* Interleaving for libsndfile. */
-    float sf_output[nchannels * nframes];
-    for (int i = 0; i < nframes; i++) {
-      /* First, write all the obvious channels */
-      for (int j = 0; j < min(outs, nchannels); j++) {
-	/* If outs > nchannels, we *could* do mixing - but don't. */
-	sf_output[i * nchannels + j] = pluginOutputBuffers[j][i];
-      }
-      /* Then, if user wants *more* output channels than there are
-       * audio output ports (ie outs < nchannels), copy the last audio
-       * out to all the remaining channels. If outs >= nchannels, this
-       * loop is never entered. */
-      for (int j = outs; j < nchannels; j++) {
-	sf_output[i * nchannels + j] = pluginOutputBuffers[outs - 1][i];
+    if (opts->time_blocks) {
+      double block_time = get_time() - block_start;
+      size_t denormals = 0;
+      float peak = 0.0f;
+      for (int j = 0; j < outs; j++) {
+	denormals += count_denormals(pluginOutputBuffers[j], nframes);
+	for (int i = 0; i < nframes; i++) {
+	  if (fabsf(pluginOutputBuffers[j][i]) > peak) {
+	    peak = fabsf(pluginOutputBuffers[j][i]);
+	  }
+	}
       }
+      block_stats_add(&inst->block_stats, block_time, denormals, peak);
     }
 
-    if (clip) {
-      for (int i = 0; i < nframes * nchannels; i++) {
-	if (!finite(sf_output[i])) {
-	  if (!have_warned) {
-	    have_warned = 1;
-	    fprintf(stderr, 
-		    "%s: Warning: clipping NaN or Inf in synthesized data\n", 
-		    my_name);
-	  }
-	  if (sf_output[i] < 0.0f) {
-	    sf_output[i] = -1.0f;
-	  } else {
-	    sf_output[i] = 1.0f;
-	  }
-	} else {
-	  if (sf_output[i] < -1.0f) {
-	    if (!have_warned) {
-	      have_warned = 1;
-	      fprintf(stderr, 
-		      "%s: Warning: clipping out-of-bounds value in synthesized data\n", 
-		      my_name);
-	    }
-	    sf_output[i] = -1.0f;
-	  } else if (sf_output[i] > 1.0f) {
-	    if (!have_warned) {
-	      have_warned = 1;
-	      fprintf(stderr, 
-		      "%s: Warning: clipping out-of-bounds value in synthesized data\n", 
-		      my_name);
-	    }
-	    sf_output[i] = 1.0f;
-	  }
-	}
+    int silent = 1;
+
+    for (int f = 0; f < noutputs; f++) {
+      const routing_t *routing = &opts->outputs[f].routing;
+      size_t nsamples = nframes * routing->nchannels;
+
+      /* Mixing and interleaving for libsndfile. */
+      float *sf_output = output_block(&output[f]);
+      mix_interleave(sf_output, routing, pluginOutputBuffers, nframes);
+
+      if (check_output(sf_output, nsamples, opts->clip, &have_warned)) {
+	status = 1;
+	goto done;
       }
-    } else {
-      for (int i = 0; i < nframes * nchannels; i++) {
-	if (!finite(sf_output[i])) {
-	  fprintf(stderr, "%s: Error: NaN or Inf in synthesized data\n",
-		  my_name);
-	  exit(1);
-	}
-	if (sf_output[i] > 1.0f
-	    || sf_output[i] < -1.0f) {
-	  fprintf(stderr, "%s: Error: sample data out of bounds\n",
-		  my_name);
-	  exit(1);
-	}
+
+      silent = silent && is_silent(sf_output, nsamples);
+
+      /* Write the audio (or hand it to the writer thread) */
+      if (output_commit(&output[f])) {
+	status = 1;
+	goto done;
       }
     }
 
-    /* Write the audio */
-    if ((items_written = sf_writef_float(outfile, 
-					 sf_output,
-					 nframes)) != nframes) {
-      fprintf(stderr, "%s: Error: can't write data to output file %s\n", 
-	      my_name, output_file);
-      fprintf(stderr, "%s: %s\n", my_name, sf_strerror(outfile));
-      return 1;
-    }
-    
-    total_written += items_written;
-    if (release_tail >= 0) {
-      if (total_written > length + release_tail) {
+    total_written += nframes;
+    if (release_tail != (size_t) -1) {
+      if (input_done && total_written > length + release_tail) {
 	finished = 1;
       }
     } else {
-      if (total_written > length 
-	  && is_silent(sf_output, nframes * nchannels)) {
+      if (total_written > length && silent && input_done) {
 	finished = 1;
-      } else if (total_written > MAX_LENGTH * sample_rate) {
+      } else if (input_done && total_written > MAX_LENGTH * sample_rate +
+		 (have_input ? (length > input_end ? length : input_end) : 0)) {
 	/* The default sineshaper patch never releases, after a note-off,
-	 * to silence. So truncate. This is sineshaper 0.3.0 (so maybe it's 
+	 * to silence. So truncate. This is sineshaper 0.3.0 (so maybe it's
 	 * different in the new version) and here I mean the default
-	 * patch as returned by the get_port_default() function, not the 
+	 * patch as returned by the get_port_default() function, not the
 	 * default set by the sineshaper UI.
 	 */
 	finished = 1;
-	fprintf(stderr, "%s: Warning: truncating after writing %d frames\n", 
+	fprintf(stderr, "%s: Warning: truncating after writing %zu frames\n",
 		my_name, total_written);
       }
     }
   }
 
-  fprintf(stdout, "%s: Wrote %d frames to %s\n", 
-	  my_name, total_written, output_file);
-    
-  sf_close(outfile);
-    
-  /* Clean up */
+ done:
+  allocations_in_loop = heap_allocations - allocations_in_loop;
+  if (have_input) {
+    input_close(input);
+  }
+
+  for (int f = 0; f < nopen; f++) {
+    if (output_close(&output[f])) {
+      fprintf(stderr, "%s: Error: can't write data to output file %s\n",
+	      my_name, output_file[f]);
+      fprintf(stderr, "%s: %s\n", my_name, sf_strerror(outfile[f]));
+      status = 1;
+    }
+    sf_close(outfile[f]);
+  }
+
+  if (!status) {
+    inst->frames_written = total_written;
+    for (int f = 0; f < noutputs; f++) {
+      fprintf(stdout, "%s: Wrote %zu frames to %s\n",
+	      my_name, total_written, output_file[f]);
+    }
+
+    if (opts->time_blocks) {
+      /* (wall clock, including mixing and writing the files) */
+      double render_time = get_time() - render_start;
+      block_stats_report(&inst->block_stats, nframes);
+      fprintf(stderr, "%s: rendered %zu frames in %.3f s, %.0f frames/s\n",
+	      my_name, total_written, render_time,
+	      total_written / render_time);
+      fprintf(stderr, "%s: host allocations: %zu setting up, "
+	      "%zu while rendering\n", my_name,
+	      heap_allocations - allocations_at_start - allocations_in_loop,
+	      allocations_in_loop);
+    }
+  } else {
+    /* Don't leave truncated files lying around */
+    for (int f = 0; f < nopen; f++) {
+      unlink(output_file[f]);
+    }
+  }
 
   if (descriptor->LADSPA_Plugin->deactivate) {
     descriptor->LADSPA_Plugin->deactivate(instanceHandle);
   }
-  
-  if (descriptor->LADSPA_Plugin->cleanup) {
-    descriptor->LADSPA_Plugin->cleanup(instanceHandle);
+
+  return status;
+}
+
+
+/* Jobs next_job .. end_job-1 of a batch, and what's been done with
+ * them: there's one queue per NUMA node with -A workers on it (else
+ * just one), allocated on that node and padded to whole cache lines so
+ * the nodes don't fight over them */
+typedef struct {
+  int node;                   /* or -1 */
+  int nworkers;
+  uint64_t next_job;
+  uint64_t end_job;
+  uint64_t renders;           /* by this node's workers, from any queue */
+  uint64_t frames;
+  pthread_mutex_t lock;
+} job_queue_t;
+
+/* A batch of renders shared between the worker threads: random
+ * patches (-N) or programs (-p all). Each worker has its own instance
+ * and takes the next job from its own node's queue, or from another
+ * node's once that's empty, until there are none left. */
+typedef struct {
+  const DSSI_Descriptor *descriptor;
+  const render_opts_t *opts;
+  port_vals_source_t src;     /* from_random or from_preset */
+  uint64_t seed;
+  DSSI_Program_Descriptor *programs;
+  instance_t *spare;          /* already instantiated, for any worker */
+  job_queue_t **queues;
+  int nqueues;
+  uint64_t failed;
+  int starting;               /* workers still making their instances */
+  int live;                   /* workers with an instance */
+  pthread_mutex_t lock;       /* for spare, failed, starting and live */
+} batch_t;
+
+typedef struct {
+  batch_t *batch;
+  int cpu;                    /* to pin the thread to, or -1 */
+  int queue;                  /* index of its own node's queue */
+} worker_t;
+
+void
+write_patch(instance_t *inst, const char *file) {
+  FILE *fp = fopen(file, "w");
+
+  if (!fp) {
+    fprintf(stderr, "%s: Warning: can't write patch file %s\n",
+	    my_name, file);
+    return;
+  }
+  for (int i = 0; i < inst->controlIns; i++) {
+    fprintf(fp, "%s%.9g", i ? " " : "", inst->pluginControlIns[i]);
+  }
+  fprintf(fp, "\n");
+  fclose(fp);
+}
+
+/* eg 000-003-Bright_Pad: bank, program and a file-name-safe name */
+void
+make_program_tag(char *buf, size_t size,
+		 const DSSI_Program_Descriptor *program) {
+  size_t len;
+
+  snprintf(buf, size, "%03lu-%03lu-%s", program->Bank, program->Program,
+	   program->Name ? program->Name : "");
+  len = strlen(buf);
+  for (size_t i = 8; i < len; i++) {
+    if (!isalnum((unsigned char) buf[i]) && buf[i] != '-' && buf[i] != '_') {
+      buf[i] = '_';
+    }
+  }
+  if (buf[len - 1] == '-') {
+    buf[len - 1] = '\0';
   }
+}
 
+/* Take the next job, trying the queue home first */
+int
+take_job(batch_t *batch, int home, uint64_t *job) {
+  for (int k = 0; k < batch->nqueues; k++) {
+    job_queue_t *q = batch->queues[(home + k) % batch->nqueues];
+    int found;
+
+    pthread_mutex_lock(&q->lock);
+    found = (q->next_job < q->end_job);
+    if (found) {
+      *job = q->next_job++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (found) {
+      return 1;
+    }
+  }
   return 0;
 }
 
+void *
+batch_worker(void *arg) {
+  worker_t *worker = arg;
+  batch_t *batch = worker->batch;
+  job_queue_t *home = batch->queues[worker->queue];
+  instance_t *inst;
+  uint64_t job;
+  char tag[80];
+  char prs_file[PATH_MAX];
+
+  /* Pin before allocating anything, so that the instance (and whatever
+   * the plugin allocates) ends up on this CPU's node */
+  if (worker->cpu >= 0) {
+    if (pin_thread(worker->cpu)) {
+      fprintf(stderr, "%s: Warning: can't pin a worker to CPU %d\n",
+	      my_name, worker->cpu);
+    }
+    alloc_node = home->node;
+  }
+
+  if (batch->opts->flush_denormals) {
+    set_denormal_mode();
+  }
+
+  pthread_mutex_lock(&batch->lock);
+  inst = batch->spare;
+  batch->spare = NULL;
+  pthread_mutex_unlock(&batch->lock);
+
+  if (!inst) {
+    inst = create_instance(batch->descriptor, batch->opts->nframes);
+  }
+
+  /* A worker without an instance leaves its jobs to the others, unless
+   * there aren't any others: then the last one to fail fails the lot */
+  pthread_mutex_lock(&batch->lock);
+  batch->starting--;
+  if (inst) {
+    batch->live++;
+  }
+  int drain = !inst && !batch->starting && !batch->live;
+  pthread_mutex_unlock(&batch->lock);
+
+  if (!inst) {
+    fprintf(stderr, "%s: %s: Failed to instantiate plugin \"%s\"%s\n",
+	    my_name, drain ? "Error" : "Warning",
+	    batch->descriptor->LADSPA_Plugin->Label,
+	    drain ? "" : " on a worker thread; the others will carry on");
+    for (int k = 0; drain && k < batch->nqueues; k++) {
+      job_queue_t *q = batch->queues[k];
+      uint64_t left;
+
+      pthread_mutex_lock(&q->lock);
+      left = q->end_job - q->next_job;
+      q->next_job = q->end_job;
+      pthread_mutex_unlock(&q->lock);
+
+      pthread_mutex_lock(&batch->lock);
+      batch->failed += left;
+      pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+  }
+
+  while (take_job(batch, worker->queue, &job)) {
+    if (batch->src == from_random) {
+      snprintf(tag, sizeof(tag), "%06llu", (unsigned long long) job);
+      set_control_ins(inst, from_random, 0, 0, batch->seed, job);
+    } else {
+      const DSSI_Program_Descriptor *program = &batch->programs[job];
+      make_program_tag(tag, sizeof(tag), program);
+      set_control_ins(inst, from_preset, program->Bank, program->Program,
+		      0, 0);
+    }
+    repair_control_ins(inst);
+
+    if (render(inst, batch->opts, tag)) {
+      pthread_mutex_lock(&batch->lock);
+      batch->failed++;
+      pthread_mutex_unlock(&batch->lock);
+      continue;
+    }
+
+    pthread_mutex_lock(&home->lock);
+    home->renders++;
+    home->frames += inst->frames_written;
+    pthread_mutex_unlock(&home->lock);
+
+    make_output_name(prs_file, sizeof(prs_file), batch->opts->outputs[0].file,
+		     tag, ".prs");
+    write_patch(inst, prs_file);
+  }
+
+  free_instance(inst);
+  return NULL;
+}
+
+/* Set up the workers and the job queues for jobs first .. end-1. With
+ * affinity, the workers are pinned to CPUs round the NUMA nodes, and
+ * each node in use gets a queue with a share of the jobs in proportion
+ * to its workers; otherwise (or without libnuma) there's one queue and
+ * no pinning. Returns nonzero if the workers are pinned. */
+int
+plan_batch(batch_t *batch, worker_t *workers, int nworkers,
+	   uint64_t first, uint64_t end, int affinity) {
+  int cpu[nworkers], node[nworkers];
+  int pinned = 0;
+
+  if (affinity) {
+    if (!numa_load()) {
+      fprintf(stderr, "%s: Warning: libnuma isn't available, so -A is "
+	      "ignored\n", my_name);
+    } else if (!(pinned = place_workers(cpu, node, nworkers))) {
+      fprintf(stderr, "%s: Warning: can't tell which CPUs to use, so -A is "
+	      "ignored\n", my_name);
+    }
+  }
+  if (!pinned) {
+    for (int i = 0; i < nworkers; i++) {
+      cpu[i] = node[i] = -1;
+    }
+  }
+
+  /* One queue per node, in order of first use */
+  batch->queues = host_alloc(nworkers * sizeof(job_queue_t *));
+  batch->nqueues = 0;
+  for (int i = 0; i < nworkers; i++) {
+    int q = 0;
+
+    while (q < batch->nqueues && batch->queues[q]->node != node[i]) {
+      q++;
+    }
+    if (q == batch->nqueues) {
+      job_queue_t *queue = node_alloc(arena_round(sizeof(job_queue_t)),
+				      node[i]);
+      memset(queue, 0, sizeof(job_queue_t));
+      queue->node = node[i];
+      pthread_mutex_init(&queue->lock, NULL);
+      batch->queues[batch->nqueues++] = queue;
+    }
+    batch->queues[q]->nworkers++;
+    workers[i].batch = batch;
+    workers[i].cpu = cpu[i];
+    workers[i].queue = q;
+  }
+
+  /* Contiguous ranges (n * before / nworkers, without overflowing) */
+  uint64_t n = end - first;
+  int before = 0;
+  for (int q = 0; q < batch->nqueues; q++) {
+    job_queue_t *queue = batch->queues[q];
+
+    queue->next_job = first + n / nworkers * before +
+      n % nworkers * before / nworkers;
+    before += queue->nworkers;
+    queue->end_job = first + n / nworkers * before +
+      n % nworkers * before / nworkers;
+  }
+  return pinned;
+}
+
+/* Report what each node did, if asked, and free the queues */
+void
+finish_batch(batch_t *batch, double seconds, int report) {
+  int nworkers = 0;
+  unsigned long long renders = 0, frames = 0;
+
+  for (int q = 0; q < batch->nqueues; q++) {
+    job_queue_t *queue = batch->queues[q];
+
+    if (report) {
+      fprintf(stderr, "%s: node %d: %d workers, %llu renders, %llu frames, "
+	      "%.0f frames/s\n", my_name, queue->node, queue->nworkers,
+	      (unsigned long long) queue->renders,
+	      (unsigned long long) queue->frames, queue->frames / seconds);
+    }
+    nworkers += queue->nworkers;
+    renders += queue->renders;
+    frames += queue->frames;
+
+    pthread_mutex_destroy(&queue->lock);
+    node_free(queue, arena_round(sizeof(job_queue_t)), queue->node);
+  }
+  if (report) {
+    fprintf(stderr, "%s: all nodes: %d workers, %llu renders, %llu frames, "
+	    "%.0f frames/s\n", my_name, nworkers, renders, frames,
+	    frames / seconds);
+  }
+  free(batch->queues);
+}
+
+/* Copy the programs in one bank, or in all banks if bank < 0, out of
+ * the plugin and into arena. Returns how many there are. */
+uint64_t
+list_programs(instance_t *inst, arena_t *arena, long bank,
+	      DSSI_Program_Descriptor **programs) {
+  const DSSI_Program_Descriptor *program;
+  uint64_t n = 0;
+
+  for (int i = 0; (program = inst->descriptor->get_program(inst->handle, i));
+       i++) {
+    if (bank < 0 || program->Bank == bank) {
+      n++;
+    }
+  }
+
+  *programs = arena_alloc(arena, n * sizeof(DSSI_Program_Descriptor));
+  n = 0;
+  for (int i = 0; (program = inst->descriptor->get_program(inst->handle, i));
+       i++) {
+    if (bank >= 0 && program->Bank != bank) {
+      continue;
+    }
+    (*programs)[n].Bank = program->Bank;
+    (*programs)[n].Program = program->Program;
+    (*programs)[n].Name = program->Name ?
+      arena_strdup(arena, program->Name) : NULL;
+    n++;
+  }
+  return n;
+}
+
+/* Describe every plugin in the library (or just the one with this
+ * label) as JSON on stdout: the port layout, with control inputs
+ * numbered in the order they're read from stdin, plus hints, bounds
+ * and defaults, the programs, and which DSSI methods exist. Plugins
+ * are only instantiated to list their programs. */
+void
+describe_library(DSSI_Descriptor_Function descfn, const char *dllName,
+		 const char *directory, const char *label) {
+  const DSSI_Descriptor *desc;
+  FILE *fp = stdout;
+  int first = 1;
+
+  fprintf(fp, "{\n  \"library\": ");
+  json_string(fp, dllName);
+  fprintf(fp, ",\n  \"directory\": ");
+  json_string(fp, directory);
+  fprintf(fp, ",\n  \"sample_rate\": %d,\n  \"plugins\": [", SAMPLE_RATE);
+
+  for (int d = 0; (desc = descfn(d)); d++) {
+    const LADSPA_Descriptor *plugin = desc->LADSPA_Plugin;
+    int controlIn = 0;
+
+    if (label && strcmp(plugin->Label, label)) {
+      continue;
+    }
+
+    fprintf(fp, "%s\n    {\n      \"index\": %d,\n      \"label\": ",
+	    first ? "" : ",", d);
+    json_string(fp, plugin->Label);
+    fprintf(fp, ",\n      \"name\": ");
+    json_string(fp, plugin->Name);
+    fprintf(fp, ",\n      \"maker\": ");
+    json_string(fp, plugin->Maker);
+    fprintf(fp, ",\n      \"copyright\": ");
+    json_string(fp, plugin->Copyright);
+    fprintf(fp, ",\n      \"unique_id\": %lu", plugin->UniqueID);
+    fprintf(fp, ",\n      \"dssi_api_version\": %d", desc->DSSI_API_Version);
+    fprintf(fp, ",\n      \"run_synth\": %s", json_bool(desc->run_synth != NULL));
+    fprintf(fp, ",\n      \"run_synth_adding\": %s",
+	    json_bool(desc->run_synth_adding != NULL));
+    fprintf(fp, ",\n      \"run_multiple_synths\": %s",
+	    json_bool(desc->run_multiple_synths != NULL));
+    fprintf(fp, ",\n      \"run_multiple_synths_adding\": %s",
+	    json_bool(desc->run_multiple_synths_adding != NULL));
+    fprintf(fp, ",\n      \"configure\": %s", json_bool(desc->configure != NULL));
+    fprintf(fp, ",\n      \"select_program\": %s",
+	    json_bool(desc->select_program != NULL));
+    fprintf(fp, ",\n      \"ports\": [");
+
+    for (int j = 0; j < plugin->PortCount; j++) {
+      LADSPA_PortDescriptor pod = plugin->PortDescriptors[j];
+      LADSPA_PortRangeHint hint = plugin->PortRangeHints[j];
+      LADSPA_PortRangeHintDescriptor prhd = hint.HintDescriptor;
+
+      fprintf(fp, "%s\n        { \"index\": %d, \"name\": ", j ? "," : "", j);
+      json_string(fp, plugin->PortNames[j]);
+      fprintf(fp, ", \"type\": \"%s\", \"direction\": \"%s\"",
+	      LADSPA_IS_PORT_AUDIO(pod) ? "audio" : "control",
+	      LADSPA_IS_PORT_INPUT(pod) ? "input" : "output");
+
+      if (LADSPA_IS_PORT_CONTROL(pod) && LADSPA_IS_PORT_INPUT(pod)) {
+	fprintf(fp, ", \"control_in\": %d", controlIn++);
+      }
+
+      fprintf(fp, ", \"hints\": [");
+      int nhints = 0;
+      if (LADSPA_IS_HINT_BOUNDED_BELOW(prhd)) {
+	fprintf(fp, "%s\"bounded_below\"", nhints++ ? ", " : "");
+      }
+      if (LADSPA_IS_HINT_BOUNDED_ABOVE(prhd)) {
+	fprintf(fp, "%s\"bounded_above\"", nhints++ ? ", " : "");
+      }
+      if (LADSPA_IS_HINT_TOGGLED(prhd)) {
+	fprintf(fp, "%s\"toggled\"", nhints++ ? ", " : "");
+      }
+      if (LADSPA_IS_HINT_SAMPLE_RATE(prhd)) {
+	fprintf(fp, "%s\"sample_rate\"", nhints++ ? ", " : "");
+      }
+      if (LADSPA_IS_HINT_LOGARITHMIC(prhd)) {
+	fprintf(fp, "%s\"logarithmic\"", nhints++ ? ", " : "");
+      }
+      if (LADSPA_IS_HINT_INTEGER(prhd)) {
+	fprintf(fp, "%s\"integer\"", nhints++ ? ", " : "");
+      }
+      fprintf(fp, "]");
+
+      /* Bounds as the plugin gives them (times the sample rate, if it
+       * says so) */
+      float scale = LADSPA_IS_HINT_SAMPLE_RATE(prhd) ? sample_rate : 1.0f;
+      if (LADSPA_IS_HINT_BOUNDED_BELOW(prhd)) {
+	fprintf(fp, ", \"lower\": ");
+	json_number(fp, hint.LowerBound * scale);
+      }
+      if (LADSPA_IS_HINT_BOUNDED_ABOVE(prhd)) {
+	fprintf(fp, ", \"upper\": ");
+	json_number(fp, hint.UpperBound * scale);
+      }
+      if (LADSPA_IS_PORT_CONTROL(pod) && LADSPA_IS_PORT_INPUT(pod)) {
+	fprintf(fp, ", \"default\": ");
+	json_number(fp, get_port_default(plugin, j));
+      }
+      fprintf(fp, " }");
+    }
+    fprintf(fp, "%s],\n      \"programs\": ", plugin->PortCount ? "\n      " : "");
+
+    /* Programs can only be listed from an instance */
+    if (desc->get_program) {
+      LADSPA_Handle handle = plugin->instantiate(plugin, sample_rate);
+      const DSSI_Program_Descriptor *program;
+
+      fprintf(fp, "[");
+      for (int i = 0; handle && (program = desc->get_program(handle, i)); i++) {
+	fprintf(fp, "%s\n        { \"bank\": %lu, \"program\": %lu, \"name\": ",
+		i ? "," : "", program->Bank, program->Program);
+	json_string(fp, program->Name);
+	fprintf(fp, " }");
+      }
+      fprintf(fp, "]");
+      if (handle && plugin->cleanup) {
+	plugin->cleanup(handle);
+      }
+    } else {
+      fprintf(fp, "null");
+    }
+    fprintf(fp, "\n    }");
+    first = 0;
+  }
+
+  fprintf(fp, "\n  ]\n}\n");
+}
+
+int
+main(int argc, char **argv) {
+
+  my_name = basename(argv[0]);
+
+  DSSI_Descriptor_Function descfn;
+  const DSSI_Descriptor *descriptor;
+  instance_t *inst;
+  void *pluginObject;
+
+  render_opts_t opts = { 0 };
+  arena_t args;  /* everything from the command line, until exit */
+
+  char *directory = NULL;
+  char *dllName = NULL;
+  char *label;
+  char *output_file = NULL;
+
+  port_vals_source_t src = from_stdin;
+  int bank = 0;
+  int program_no = 0;
+  int have_seed = 0;
+  uint64_t seed = 0;
+  uint64_t first_patch = 0;
+  uint64_t npatches = 0;
+  int nthreads = 1;
+  int affinity = 0;
+  int have_length = 0;
+  int describe = 0;
+  int all_programs = 0;
+
+  opts.length = SAMPLE_RATE;
+  opts.release_tail = -1;
+  opts.nframes = 256;
+  opts.nchannels = 1;
+  opts.midi_note = 60;
+  opts.midi_velocity = 127;
+
+  sample_rate = SAMPLE_RATE;
+
+  if (argc < 2) {
+    print_usage();
+  }
+
+  /* (argc is more than enough of each) */
+  arena_init(&args, 4096);
+  opts.configure_key = arena_alloc(&args, argc * sizeof(char *));
+  opts.configure_val = arena_alloc(&args, argc * sizeof(char *));
+  opts.outputs = arena_alloc(&args, (argc + 1) * sizeof(output_spec_t));
+
+  /* dll name is argv[1]: parse dll name, plus a label if supplied */
+  parse_keyval(argv[1], LABEL_SEP, &dllName, &label);
+
+  for (int i = 2; i < argc; i++) {
+    if (DEBUG) {
+      fprintf(stderr, "%s: processing options: argv[%d] = %s\n",
+	      my_name, i, argv[i]);
+    }
+
+    /* Deal with flags */
+    if (!strcmp(argv[i], "-b")) {
+      opts.clip = 1;
+      continue;
+    } else if (!strcmp(argv[i], "-z")) {
+      opts.flush_denormals = 1;
+      continue;
+    } else if (!strcmp(argv[i], "-T")) {
+      opts.time_blocks = 1;
+      continue;
+    } else if (!strcmp(argv[i], "-A")) {
+      affinity = 1;
+      continue;
+    } else if (!strcmp(argv[i], "--describe")) {
+      describe = 1;
+      continue;
+    } else {
+      /* It's not a flag, so expect option + argument */
+      if (argc <= i + 1) print_usage();
+    }
+
+    if (!strcmp(argv[i], "-c")) {
+      opts.nchannels = strtol(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "-f")) {
+      output_file = argv[++i];
+    } else if (!strcmp(argv[i], "-n")) {
+      opts.midi_note = strtol(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "-v")) {
+      opts.midi_velocity = strtol(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "-d")) {
+      opts.projectDirectory = argv[++i];
+    } else if (!strcmp(argv[i], "-l")) {
+      opts.length = sample_rate * strtof(argv[++i], NULL);
+      have_length = 1;
+    } else if (!strcmp(argv[i], "-r")) {
+      opts.release_tail = sample_rate * strtof(argv[++i], NULL);
+    } else if (!strcmp(argv[i], "-k")) {
+      int nkeys = opts.nkeys;
+      parse_keyval(argv[++i], KEYVAL_SEP, &opts.configure_key[nkeys],
+		   &opts.configure_val[nkeys]);
+      opts.nkeys++;
+
+    } else if (!strcmp(argv[i], "-p")) {
+      char *first_str;
+      char *second_str;
+      parse_keyval(argv[++i], BANK_SEP, &first_str, &second_str);
+      if (second_str) {
+	bank = strtol(first_str, NULL, 0);
+	program_no = strtol(second_str, NULL, 0);
+      } else {
+	program_no = strtol(first_str, NULL, 0);
+	bank = 0;
+      }
+      npatches = 0;
+      if (!strcmp(second_str ? second_str : first_str, "all")) {
+	/* <bank>:all or all */
+	all_programs = 1;
+	bank = second_str ? bank : -1;
+	src = from_preset;
+      } else if (program_no == -1) {
+	src = from_defaults;
+      } else if (program_no == -2) {
+	src = from_random;
+      } else {
+	src = from_preset;
+      }
+    } else if (!strcmp(argv[i], "-s")) {
+      seed = strtoull(argv[++i], NULL, 0);
+      have_seed = 1;
+    } else if (!strcmp(argv[i], "-N")) {
+      char *first_str;
+      char *second_str;
+      parse_keyval(argv[++i], BANK_SEP, &first_str, &second_str);
+      if (second_str) {
+	first_patch = strtoull(first_str, NULL, 0);
+	npatches = strtoull(second_str, NULL, 0);
+      } else {
+	first_patch = 0;
+	npatches = strtoull(first_str, NULL, 0);
+      }
+      src = from_random;
+      all_programs = 0;
+    } else if (!strcmp(argv[i], "-x")) {
+      output_spec_t *spec;
+      char *file;
+      char *matrix;
+      parse_keyval(argv[++i], KEYVAL_SEP, &file, &matrix);
+      if (!matrix) {
+	fprintf(stderr, "%s: Error: -x needs <output_file>%c<matrix>\n",
+		my_name, KEYVAL_SEP);
+	print_usage();
+      }
+      spec = &opts.outputs[opts.noutputs++];
+      spec->file = file;
+      spec->matrix = matrix;
+    } else if (!strcmp(argv[i], "-i")) {
+      opts.input_file = argv[++i];
+    } else if (!strcmp(argv[i], "-w")) {
+      opts.nbuffers = strtol(argv[++i], NULL, 0);
+      if (opts.nbuffers < 0) {
+	opts.nbuffers = 0;
+      }
+    } else if (!strcmp(argv[i], "-j")) {
+      nthreads = strtol(argv[++i], NULL, 0);
+      if (nthreads <= 0) {
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+      }
+    } else {
+      fprintf(stderr, "%s: Error: Unknown option: %s\n", my_name, argv[i]);
+      print_usage();
+    }
+  }
+
+  if (DEBUG) {
+    for (int i = 0; i < opts.nkeys; i++) {
+      printf("key %d: %s; value: %s\n", i, opts.configure_key[i],
+	     opts.configure_val[i]);
+    }
+  }
+
+  if (DEBUG) {
+    fprintf(stderr, "%s: Cmd-line args ok\n", my_name);
+  }
+
+  if (src == from_random && !have_seed) {
+    /* Probably an unorthodox seeding technique... but print it, so
+     * that the patch can be reproduced with -s */
+    struct timeval tv;
+    struct timezone tz;
+    gettimeofday(&tv, &tz);
+    seed = tv.tv_sec * 1000000ULL + tv.tv_usec;
+    fprintf(stderr, "%s: random seed is %llu\n",
+	    my_name, (unsigned long long) seed);
+  }
+
+  directory = load(dllName, &pluginObject, describe);
+  if (!directory || !pluginObject) {
+    fprintf(stderr, "\n%s: Error: Failed to load plugin library \"%s\"\n",
+	    my_name, dllName);
+    return 1;
+  }
+
+  descfn = (DSSI_Descriptor_Function)dlsym(pluginObject,
+					   "dssi_descriptor");
+
+  if (!descfn) {
+    fprintf(stderr, "%s: Error: Not a DSSI plugin\n", my_name);
+    exit(1);
+  }
+
+
+  /* Get the plugin descriptor (and check the label before --describe
+   * prints anything) */
+  int j = 0;
+  descriptor = NULL;
+  const DSSI_Descriptor *desc;
+
+  while ((desc = descfn(j++))) {
+    if (!label ||
+	!strcmp(desc->LADSPA_Plugin->Label, label)) {
+      descriptor = desc;
+      break;
+    }
+  }
+
+  if (!descriptor && (label || !describe)) {
+    fprintf(stderr,
+	    "\n%s: Error: Plugin label \"%s\" not found in library \"%s\"\n",
+	    my_name, label ? label : "(none)", dllName);
+    arena_free(&args);
+    free(directory);
+    return 1;
+  }
+
+  if (describe) {
+    describe_library(descfn, dllName, directory, label);
+    arena_free(&args);
+    free(directory);
+    return 0;
+  }
+
+  /* Check the run_synth*() function exists */
+
+  if (!descriptor->run_synth
+      && !descriptor->run_multiple_synths) {
+    fprintf(stderr, "%s: Error: No run_synth() or run_multiple_synths() method in plugin\n", my_name);
+    exit(1);
+  }
+
+  if (!label) {
+    label = arena_strdup(&args, descriptor->LADSPA_Plugin->Label);
+  }
+
+  /* Check there is something to write */
+  int outs = 0;
+  for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {
+    LADSPA_PortDescriptor pod =
+      descriptor->LADSPA_Plugin->PortDescriptors[j];
+    if (LADSPA_IS_PORT_AUDIO(pod) && LADSPA_IS_PORT_OUTPUT(pod)) ++outs;
+  }
+
+  if (!outs) {
+    fprintf(stderr, "%s: Error: no audio output ports\n", my_name);
+    exit(1);
+  }
+  if (opts.nchannels == -1) {
+    opts.nchannels = outs;
+  }
+
+  if (opts.input_file) {
+    int ins = 0;
+    for (int j = 0; j < descriptor->LADSPA_Plugin->PortCount; j++) {
+      LADSPA_PortDescriptor pod =
+	descriptor->LADSPA_Plugin->PortDescriptors[j];
+      if (LADSPA_IS_PORT_AUDIO(pod) && LADSPA_IS_PORT_INPUT(pod)) ++ins;
+    }
+
+    if (!ins) {
+      fprintf(stderr, "%s: Warning: plugin has no audio inputs, "
+	      "ignoring %s\n", my_name, opts.input_file);
+      opts.input_file = NULL;
+    } else if (!strcmp(opts.input_file, "-") &&
+	       (src == from_stdin || npatches || all_programs)) {
+      fprintf(stderr, "%s: Error: can only read the input from stdin "
+	      "once, for one render, with -p (and not -p all)\n", my_name);
+      exit(1);
+    } else if (!have_length) {
+      /* note-off at the end of the input */
+      opts.length = -1;
+    }
+  }
+
+  /* The -f file comes first (and names the .prs files for -N). It's
+   * there by default, unless -x asked for other files instead. */
+  if (output_file || !opts.noutputs) {
+    memmove(opts.outputs + 1, opts.outputs,
+	    opts.noutputs * sizeof(output_spec_t));
+    opts.outputs[0].file = output_file ? output_file : "output.wav";
+    opts.outputs[0].matrix = NULL;
+    opts.noutputs++;
+  }
+  for (int i = 0; i < opts.noutputs; i++) {
+    output_spec_t *spec = &opts.outputs[i];
+    if (!spec->matrix) {
+      routing_default(&spec->routing, &args, opts.nchannels, outs);
+    } else if (routing_parse(&spec->routing, &args, spec->matrix, outs)) {
+      fprintf(stderr, "%s: Error: bad routing matrix \"%s\" for %s "
+	      "(the plugin has %d audio outputs)\n",
+	      my_name, spec->matrix, spec->file, outs);
+      exit(1);
+    }
+  }
+
+  /* Plugins can produce denormals from instantiate() onwards, so set
+   * this up before calling into the plugin at all. */
+  if (opts.flush_denormals && !set_denormal_mode()) {
+    fprintf(stderr, "%s: Warning: can't flush denormals on this CPU\n",
+	    my_name);
+  }
+
+  if (affinity && !npatches && !all_programs) {
+    fprintf(stderr, "%s: Warning: -A only applies to -N and -p all, so it "
+	    "is ignored\n", my_name);
+  }
+
+  if (npatches || all_programs) {
+    /* Bulk random patches or programs: one instance per worker thread */
+    batch_t batch;
+    pthread_t threads[nthreads];
+    worker_t workers[nthreads];
+    uint64_t first_job = first_patch;
+    uint64_t end_job = first_patch + npatches;
+    double start;
+    int pinned;
+
+    batch.descriptor = descriptor;
+    batch.opts = &opts;
+    batch.src = src;
+    batch.seed = seed;
+    batch.programs = NULL;
+    batch.spare = NULL;
+    batch.failed = 0;
+    batch.live = 0;
+
+    if (all_programs) {
+      /* The instance used to list the programs does the first share
+       * of the rendering */
+      if (!descriptor->get_program) {
+	fprintf(stderr, "%s: Error: plugin \"%s\" has no programs\n",
+		my_name, label);
+	return 1;
+      }
+      batch.spare = create_instance(descriptor, opts.nframes);
+      if (!batch.spare) {
+	fprintf(stderr,
+		"\n%s: Error: Failed to instantiate instance %d!, plugin \"%s\"\n",
+		my_name, 0, label);
+	return 1;
+      }
+      first_job = 0;
+      end_job = list_programs(batch.spare, &args, bank, &batch.programs);
+      if (!end_job) {
+	fprintf(stderr, "%s: Error: no programs to render\n", my_name);
+	return 1;
+      }
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    uint64_t njobs = end_job - first_job;
+    if ((uint64_t) nthreads > njobs) {
+      nthreads = njobs;
+    }
+
+    pinned = plan_batch(&batch, workers, nthreads, first_job, end_job,
+			affinity);
+    if (pinned && batch.spare) {
+      /* It was made on this thread's node: let the workers make their
+       * own instances on theirs */
+      free_instance(batch.spare);
+      batch.spare = NULL;
+    }
+
+    batch.starting = nthreads;
+    start = get_time();
+    for (int i = 0; i < nthreads; i++) {
+      pthread_create(&threads[i], NULL, batch_worker, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    finish_batch(&batch, get_time() - start, pinned);
+    pthread_mutex_destroy(&batch.lock);
+    arena_free(&args);
+    free(directory);
+
+    if (batch.failed) {
+      fprintf(stderr, "%s: Warning: %llu of %llu renders failed\n",
+	      my_name, (unsigned long long) batch.failed,
+	      (unsigned long long) njobs);
+      return 1;
+    }
+    return 0;
+  }
+
+  inst = create_instance(descriptor, opts.nframes);
+  if (!inst) {
+    fprintf(stderr,
+	    "\n%s: Error: Failed to instantiate instance %d!, plugin \"%s\"\n",
+	    my_name, 0, label);
+    return 1;
+  }
+
+  /* Set the control port values (patch 0 if random) */
+  set_control_ins(inst, src, bank, program_no, seed, 0);
+  repair_control_ins(inst);
+
+  if (render(inst, &opts, NULL)) {
+    return 1;
+  }
+
+  /* Clean up */
+
+  free_instance(inst);
+  arena_free(&args);
+  free(directory);
+
+  return 0;
+}
@@ -27,15 +27,35 @@
 #define _BSD_SOURCE    1
 #define _SVID_SOURCE   1
 #define _ISOC99_SOURCE 1
+/* for CPU affinity */
+#define _GNU_SOURCE    1
 
 
 #define DEBUG 0
 #define MAX_LENGTH (15.0f)
+/* with -T, blocks which take this many times as long as a typical
+ * fast block are reported as (probably) denormal-bound */
+#define SLOW_BLOCK_RATIO (10.0)
+#define MAX_SLOW_BLOCKS_REPORTED 20
+/* with -w, the writer thread gets this many frames at a time */
+#define WRITER_BUFFER_FRAMES 4096
+/* with -i, the reader thread reads this far ahead */
+#define READER_BUFFER_FRAMES 4096
+#define READER_BUFFERS 4
+/* buffers and arena allocations are aligned to this */
+#define CACHE_LINE 64
+/* with -N and -p all, the first render sizes each worker's arena;
+ * this is just where it starts */
+#define JOB_ARENA_BYTES (64 * 1024)
 #define SAMPLE_RATE 44100
 /* character used to separate SO names from plugin labels on command line */
 #define LABEL_SEP ':'
 #define KEYVAL_SEP '='
 #define BANK_SEP ':'
+/* separators for routing matrices: rows are output file channels,
+ * columns are plugin audio outputs */
+#define ROW_SEP '/'
+#define COL_SEP ','
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -47,8 +67,10 @@
 #include <alsa/asoundlib.h>
 #include <alsa/seq.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 #include <dlfcn.h>
 #include <unistd.h>
@@ -56,30 +78,116 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <time.h>
 #include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 
 static float sample_rate;
 static int verbose = 0;
 char *my_name;
 
-LADSPA_Data get_port_random(const LADSPA_Descriptor *plugin, int port)
+LADSPA_Data get_port_default(const LADSPA_Descriptor *plugin, int port);
+
+/* Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as
+ * 1, 2, 3", SC11). It is counter-based: the output is a pure function
+ * of (key, counter), so random patch i can be generated on any thread,
+ * in any order, and always comes out the same for a given seed. */
+void
+philox4x32_10(const uint32_t key_in[2], const uint32_t ctr_in[4],
+	      uint32_t out[4]) {
+  uint32_t key[2] = { key_in[0], key_in[1] };
+  uint32_t ctr[4] = { ctr_in[0], ctr_in[1], ctr_in[2], ctr_in[3] };
+
+  for (int round = 0; round < 10; round++) {
+    uint64_t p0 = (uint64_t) 0xD2511F53 * ctr[0];
+    uint64_t p1 = (uint64_t) 0xCD9E8D57 * ctr[2];
+    uint32_t x0 = (uint32_t) (p1 >> 32) ^ ctr[1] ^ key[0];
+    uint32_t x2 = (uint32_t) (p0 >> 32) ^ ctr[3] ^ key[1];
+    ctr[0] = x0;
+    ctr[1] = (uint32_t) p1;
+    ctr[2] = x2;
+    ctr[3] = (uint32_t) p0;
+    key[0] += 0x9E3779B9;
+    key[1] += 0xBB67AE85;
+  }
+  memcpy(out, ctr, sizeof(ctr));
+}
+
+/* Uniform in [0, 1), from the 24 high bits of one Philox output word */
+float
+philox_uniform(uint64_t seed, uint64_t patch, int port) {
+  uint32_t key[2] = { (uint32_t) seed, (uint32_t) (seed >> 32) };
+  uint32_t ctr[4] = { (uint32_t) port, 0,
+		      (uint32_t) patch, (uint32_t) (patch >> 32) };
+  uint32_t out[4];
+
+  philox4x32_10(key, ctr, out);
+  return (out[0] >> 8) * (1.0f / 16777216.0f);
+}
+
+/* A random value for the port, the same every time for a given seed,
+ * patch number and port. */
+LADSPA_Data get_port_random(const LADSPA_Descriptor *plugin, int port,
+			    uint64_t seed, uint64_t patch)
 {
   LADSPA_PortRangeHint hint = plugin->PortRangeHints[port];
   float lower = hint.LowerBound *
     (LADSPA_IS_HINT_SAMPLE_RATE(hint.HintDescriptor) ? sample_rate : 1.0f);
   float upper = hint.UpperBound *
     (LADSPA_IS_HINT_SAMPLE_RATE(hint.HintDescriptor) ? sample_rate : 1.0f);
+  float x = philox_uniform(seed, patch, port);
+  float val;
 
-  /* FIXME: here we assume that ports are bounded, and we do not take the 
-   * logarithmic hint into account. */
+  /* Toggled ports are on or off; their bounds are meaningless */
+  if (LADSPA_IS_HINT_TOGGLED(hint.HintDescriptor)) {
+    return (x < 0.5f) ? 0.0f : 1.0f;
+  }
+
+  /* There is no uniform distribution over an unbounded range, so the
+   * best we can do is the default. */
+  if (!LADSPA_IS_HINT_BOUNDED_BELOW(hint.HintDescriptor) ||
+      !LADSPA_IS_HINT_BOUNDED_ABOVE(hint.HintDescriptor)) {
+    return get_port_default(plugin, port);
+  }
+
+  if (LADSPA_IS_HINT_INTEGER(hint.HintDescriptor)) {
+    lower = ceilf(lower);
+    upper = floorf(upper);
+    if (upper < lower) {
+      return lower;
+    }
+  }
 
-  float x = random() / (float) RAND_MAX;
+  if (LADSPA_IS_HINT_LOGARITHMIC(hint.HintDescriptor) &&
+      lower > 0.0f && upper > 0.0f) {
+    val = expf(logf(lower) + x * (logf(upper) - logf(lower)));
+    if (LADSPA_IS_HINT_INTEGER(hint.HintDescriptor)) {
+      val = roundf(val);
+    }
+  } else if (LADSPA_IS_HINT_INTEGER(hint.HintDescriptor)) {
+    /* Each integer in [lower, upper] equally likely */
+    val = lower + floorf(x * (upper - lower + 1.0f));
+  } else {
+    val = lower + x * (upper - lower);
+  }
 
-  return lower + x * (upper - lower);
+  /* Guard against rounding (in expf() or above) taking us outside */
+  if (val < lower) {
+    val = lower;
+  } else if (val > upper) {
+    val = upper;
+  }
+  return val;
 }
 
 LADSPA_Data get_port_default(const LADSPA_Descriptor *plugin, int port)
@@ -259,26 +367,1061 @@ is_silent(LADSPA_Data *data, size_t length) {
   return (sum < epsilon);
 }
 
+size_t
+count_denormals(const LADSPA_Data *data, size_t length) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    if (fpclassify(data[i]) == FP_SUBNORMAL) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/* Turn on flush-to-zero and denormals-are-zero. This is per-thread
+ * state, so it must be called by every thread that runs the plugin.
+ * Returns 0 if we don't know how to do it on this architecture. */
+int
+set_denormal_mode(void) {
+#if defined(__SSE__)
+  unsigned int csr = _mm_getcsr() | 0x8000; /* FTZ */
+#if defined(__SSE2__)
+  csr |= 0x0040; /* DAZ */
+#endif
+  _mm_setcsr(csr);
+  return 1;
+#elif defined(__aarch64__)
+  unsigned long fpcr;
+  __asm__ __volatile__ ("mrs %0, fpcr" : "=r" (fpcr));
+  fpcr |= (1UL << 24); /* FZ: flushes both inputs and outputs */
+  __asm__ __volatile__ ("msr fpcr, %0" : : "r" (fpcr));
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+double
+get_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Heap allocations made by the host on this thread, for -T. Every
+ * allocation the host makes goes through host_alloc(), host_realloc()
+ * or node_alloc(), so this shows whether the host allocates while
+ * rendering. Allocations inside libc, libsndfile and the plugin are
+ * not counted. */
+static __thread size_t heap_allocations = 0;
+
+void *
+host_alloc(size_t size) {
+  void *p;
+
+  heap_allocations++;
+  if (posix_memalign(&p, CACHE_LINE, size ? size : 1)) {
+    fprintf(stderr, "%s: Error: out of memory\n", my_name);
+    exit(1);
+  }
+  return p;
+}
+
+/* (not aligned) */
+void *
+host_realloc(void *p, size_t size) {
+  heap_allocations++;
+  p = realloc(p, size);
+  if (!p) {
+    fprintf(stderr, "%s: Error: out of memory\n", my_name);
+    exit(1);
+  }
+  return p;
+}
+
+/* libnuma, if it's installed: it's optional, so it's dlopen()ed
+ * rather than linked, and only the few functions -A needs are used */
+typedef struct {
+  int (*available)(void);
+  int (*max_node)(void);
+  int (*node_of_cpu)(int cpu);
+  void *(*alloc_onnode)(size_t size, int node);
+  void (*free)(void *p, size_t size);
+} numa_t;
+
+static numa_t numa;
+
+/* Returns nonzero if libnuma is usable */
+int
+numa_load(void) {
+  void *lib = dlopen("libnuma.so.1", RTLD_NOW);
+
+  if (!lib) {
+    return 0;
+  }
+  numa.available = dlsym(lib, "numa_available");
+  numa.max_node = dlsym(lib, "numa_max_node");
+  numa.node_of_cpu = dlsym(lib, "numa_node_of_cpu");
+  numa.alloc_onnode = dlsym(lib, "numa_alloc_onnode");
+  numa.free = dlsym(lib, "numa_free");
+  if (!numa.available || !numa.max_node || !numa.node_of_cpu ||
+      !numa.alloc_onnode || !numa.free || numa.available() < 0) {
+    memset(&numa, 0, sizeof(numa));
+    dlclose(lib);
+    return 0;
+  }
+  return 1;
+}
+
+/* The NUMA node this thread allocates arena blocks on, or -1 for
+ * wherever malloc() likes */
+static __thread int alloc_node = -1;
+
+/* Memory on a NUMA node (or anywhere, if node < 0); free it with
+ * node_free(), with the same size and node */
+void *
+node_alloc(size_t size, int node) {
+  void *p;
+
+  if (node < 0 || !numa.alloc_onnode) {
+    return host_alloc(size);
+  }
+  heap_allocations++;
+  if (!(p = numa.alloc_onnode(size, node))) {
+    fprintf(stderr, "%s: Error: out of memory on node %d\n", my_name, node);
+    exit(1);
+  }
+  return p;
+}
+
+void
+node_free(void *p, size_t size, int node) {
+  if (node < 0 || !numa.free) {
+    free(p);
+  } else {
+    numa.free(p, size);
+  }
+}
+
+/* Choose a CPU for each of nworkers threads, out of the ones we're
+ * allowed to run on, spreading them across the NUMA nodes in turn
+ * (for memory bandwidth) and then across the CPUs of each node. The
+ * list wraps round if there are more workers than CPUs. Returns 0 if
+ * it can't: without libnuma, it's better not to pin at all. */
+int
+place_workers(int *cpu, int *node, int nworkers) {
+  cpu_set_t allowed;
+  int ncpus = 0;
+
+  if (!numa.node_of_cpu ||
+      sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    return 0;
+  }
+
+  int nnodes = numa.max_node() + 1;
+  int order[CPU_SETSIZE];
+  int taken[CPU_SETSIZE] = { 0 };
+
+  /* One CPU from each node per round */
+  for (int round_found = 1; round_found; ) {
+    round_found = 0;
+    for (int n = 0; n < nnodes; n++) {
+      for (int c = 0; c < CPU_SETSIZE; c++) {
+	if (CPU_ISSET(c, &allowed) && !taken[c] &&
+	    numa.node_of_cpu(c) == n) {
+	  taken[c] = 1;
+	  order[ncpus++] = c;
+	  round_found = 1;
+	  break;
+	}
+      }
+    }
+  }
+  if (!ncpus) {
+    return 0;
+  }
+
+  for (int i = 0; i < nworkers; i++) {
+    cpu[i] = order[i % ncpus];
+    node[i] = numa.node_of_cpu(cpu[i]);
+  }
+  return 1;
+}
+
+int
+pin_thread(int cpu) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* An arena hands out zeroed, cache-line-aligned pieces of a few big
+ * blocks, and gets them all back at once with arena_reset(), which
+ * keeps the blocks for the next round. So a render which needs no more
+ * than the one before it makes no heap allocations at all. */
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  int node;               /* alloc_node when it was allocated */
+} arena_block_t;
+
+typedef struct {
+  arena_block_t *first;
+  arena_block_t *current;
+  size_t used;            /* bytes of current handed out */
+  size_t block_size;      /* smallest new block */
+} arena_t;
+
+size_t
+arena_round(size_t size) {
+  return (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+}
+
+void
+arena_init(arena_t *a, size_t block_size) {
+  a->first = a->current = NULL;
+  a->used = 0;
+  a->block_size = block_size;
+}
+
+void *
+arena_alloc(arena_t *a, size_t size) {
+  void *p;
+
+  size = arena_round(size);
+
+  /* Move on through the blocks kept from last time, and only add a
+   * new one (after the block header's cache line) at the end */
+  while (!a->current || a->used + size > a->current->size) {
+    arena_block_t *next = a->current ? a->current->next : a->first;
+    if (!next) {
+      size_t bytes = (size > a->block_size) ? size : a->block_size;
+      next = node_alloc(CACHE_LINE + bytes, alloc_node);
+      next->next = NULL;
+      next->size = bytes;
+      next->node = alloc_node;
+      if (a->current) {
+	a->current->next = next;
+      } else {
+	a->first = next;
+      }
+    }
+    a->current = next;
+    a->used = 0;
+  }
+
+  p = (char *) a->current + CACHE_LINE + a->used;
+  a->used += size;
+  memset(p, 0, size);
+  return p;
+}
+
+char *
+arena_strdup(arena_t *a, const char *s) {
+  return strcpy(arena_alloc(a, strlen(s) + 1), s);
+}
+
+void
+arena_reset(arena_t *a) {
+  a->current = NULL;
+  a->used = 0;
+}
+
+void
+arena_free(arena_t *a) {
+  while (a->first) {
+    arena_block_t *next = a->first->next;
+    node_free(a->first, CACHE_LINE + a->first->size, a->first->node);
+    a->first = next;
+  }
+  arena_reset(a);
+}
+
+
+/* Per-block timings for the -T diagnostic. The arrays are kept (and
+ * only grow) from one render to the next. */
+typedef struct {
+  double *seconds;
+  size_t *denormals;
+  float *peak;
+  double *sorted;         /* scratch for block_stats_report() */
+  size_t nblocks;
+  size_t capacity;
+} block_stats_t;
+
+void
+block_stats_add(block_stats_t *stats, double seconds, size_t denormals,
+		float peak) {
+  if (stats->nblocks == stats->capacity) {
+    stats->capacity = stats->capacity ? 2 * stats->capacity : 1024;
+    stats->seconds = host_realloc(stats->seconds,
+				  stats->capacity * sizeof(double));
+    stats->denormals = host_realloc(stats->denormals,
+				    stats->capacity * sizeof(size_t));
+    stats->peak = host_realloc(stats->peak,
+			       stats->capacity * sizeof(float));
+    stats->sorted = host_realloc(stats->sorted,
+				 stats->capacity * sizeof(double));
+  }
+  stats->seconds[stats->nblocks] = seconds;
+  stats->denormals[stats->nblocks] = denormals;
+  stats->peak[stats->nblocks] = peak;
+  stats->nblocks++;
+}
+
+int
+compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Compare each block against a typical fast block (the 10th
+ * percentile, since in a long release tail most blocks may be slow). A
+ * block much slower than that with denormals in its output is the
+ * classic release-tail slowdown; a slow block of plain zeros is more
+ * likely page faults or the scheduler. */
+void
+block_stats_report(block_stats_t *stats, size_t nframes) {
+  double total = 0.0;
+  double fast;
+  size_t nslow = 0, ndenormal = 0;
+
+  if (!stats->nblocks) {
+    return;
+  }
+
+  memcpy(stats->sorted, stats->seconds, stats->nblocks * sizeof(double));
+  qsort(stats->sorted, stats->nblocks, sizeof(double), compare_doubles);
+  fast = stats->sorted[stats->nblocks / 10];
+
+  for (size_t i = 0; i < stats->nblocks; i++) {
+    total += stats->seconds[i];
+    if (stats->seconds[i] <= SLOW_BLOCK_RATIO * fast) {
+      continue;
+    }
+    int denormal = stats->denormals[i] > 0;
+    if (denormal) {
+      ndenormal++;
+    }
+    if (nslow++ < MAX_SLOW_BLOCKS_REPORTED) {
+      fprintf(stderr, "%s: block %zu (frame %zu): %.1f us, %.1fx typical, "
+	      "%zu denormal samples, peak %g%s\n",
+	      my_name, i, i * nframes, stats->seconds[i] * 1e6,
+	      stats->seconds[i] / fast, stats->denormals[i],
+	      stats->peak[i], denormal ? " (denormal-bound?)" : "");
+    }
+  }
+
+  fprintf(stderr, "%s: run_synth: %zu blocks, %.3f ms total, "
+	  "typical %.1f us/block\n",
+	  my_name, stats->nblocks, total * 1e3, fast * 1e6);
+  if (nslow) {
+    fprintf(stderr, "%s: Warning: %zu blocks took over %.0fx the typical "
+	    "time, %zu of them look denormal-bound%s\n",
+	    my_name, nslow, SLOW_BLOCK_RATIO, ndenormal,
+	    ndenormal ? " (try -z)" : "");
+  }
+}
+
 inline int
 min(int x, int y) {
   return (x < y) ? x : y;
 }
 
 
+/* Split input at the first sep, in place (so it mustn't be needed
+ * whole again) */
 void
 parse_keyval(char *input, char sep, char **key, char **val) {
   
   char *tmp = strchr(input, sep);
   if (tmp) {
-    *key = calloc(1, tmp - input + 1);
-    strncpy(*key, input, tmp - input);
-    *val = strdup(tmp + 1);
+    *tmp = '\0';
+    *key = input;
+    *val = tmp + 1;
   } else {
-    *key = strdup(input);
+    *key = input;
     *val = NULL;
   }
 }
 
+/* Gains from the plugin's audio outputs to the channels of an output
+ * file. Only the nonzero gains are kept, per channel, so that a plain
+ * copy doesn't pay for the whole matrix. */
+typedef struct {
+  int nchannels;
+  int outs;
+  int *nterms;       /* per channel: number of nonzero gains */
+  int *term_out;     /* nchannels * outs: which plugin output */
+  float *term_gain;  /* nchannels * outs: and its gain */
+} routing_t;
+
+void
+routing_init(routing_t *r, arena_t *arena, int nchannels, int outs) {
+  r->nchannels = nchannels;
+  r->outs = outs;
+  r->nterms = arena_alloc(arena, nchannels * sizeof(int));
+  r->term_out = arena_alloc(arena, nchannels * outs * sizeof(int));
+  r->term_gain = arena_alloc(arena, nchannels * outs * sizeof(float));
+}
+
+void
+routing_set(routing_t *r, int channel, int out, float gain) {
+  int *n = &r->nterms[channel];
+
+  if (gain != 0.0f) {
+    r->term_out[channel * r->outs + *n] = out;
+    r->term_gain[channel * r->outs + *n] = gain;
+    (*n)++;
+  }
+}
+
+/* The original channel layout: out i to channel i, dropping outputs
+ * if outs > nchannels and repeating the last one if outs < nchannels */
+void
+routing_default(routing_t *r, arena_t *arena, int nchannels, int outs) {
+  routing_init(r, arena, nchannels, outs);
+  for (int c = 0; c < nchannels; c++) {
+    routing_set(r, c, min(c, outs - 1), 1.0f);
+  }
+}
+
+/* Parse eg "1,0,0.5/0,1,0.5" (stereo from three outputs). Missing
+ * gains at the end of a row are 0. Returns 0 if it makes sense. */
+int
+routing_parse(routing_t *r, arena_t *arena, const char *matrix, int outs) {
+  const char *p;
+  char *end;
+  int nchannels = 1;
+
+  for (p = matrix; *p; p++) {
+    if (*p == ROW_SEP) nchannels++;
+  }
+  routing_init(r, arena, nchannels, outs);
+
+  p = matrix;
+  for (int c = 0; c < nchannels; c++) {
+    for (int out = 0; *p && *p != ROW_SEP; out++) {
+      float gain = strtof(p, &end);
+      if (end == p || out >= outs || !isfinite(gain)) {
+	return -1;
+      }
+      routing_set(r, c, out, gain);
+      p = end;
+      if (*p == COL_SEP) p++;
+    }
+    if (*p == ROW_SEP) p++;
+  }
+  return 0;
+}
+
+/* Mix the plugin's outputs through the routing matrix and interleave
+ * them for libsndfile, in one pass. With SSE, four frames of one
+ * channel are mixed at a time; mono and stereo are stored straight
+ * into the interleaved buffer, other layouts are scattered. */
+void
+mix_interleave(float *dst, const routing_t *r, float **src, size_t nframes) {
+  int nchannels = r->nchannels;
+  size_t i = 0;
+
+#if defined(__SSE__)
+  for (; i + 4 <= nframes; i += 4) {
+    __m128 left = _mm_setzero_ps();
+    for (int c = 0; c < nchannels; c++) {
+      const int *term_out = r->term_out + c * r->outs;
+      const float *term_gain = r->term_gain + c * r->outs;
+      __m128 acc = _mm_setzero_ps();
+
+      for (int t = 0; t < r->nterms[c]; t++) {
+	acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(term_gain[t]),
+					 _mm_loadu_ps(src[term_out[t]] + i)));
+      }
+
+      if (nchannels == 1) {
+	_mm_storeu_ps(dst + i, acc);
+      } else if (nchannels == 2) {
+	if (c == 0) {
+	  left = acc;
+	} else {
+	  _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(left, acc));
+	  _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(left, acc));
+	}
+      } else {
+	float tmp[4];
+	_mm_storeu_ps(tmp, acc);
+	for (int k = 0; k < 4; k++) {
+	  dst[(i + k) * nchannels + c] = tmp[k];
+	}
+      }
+    }
+  }
+#endif
+
+  for (; i < nframes; i++) {
+    for (int c = 0; c < nchannels; c++) {
+      const int *term_out = r->term_out + c * r->outs;
+      const float *term_gain = r->term_gain + c * r->outs;
+      float acc = 0.0f;
+
+      for (int t = 0; t < r->nterms[c]; t++) {
+	acc += term_gain[t] * src[term_out[t]][i];
+      }
+      dst[i * nchannels + c] = acc;
+    }
+  }
+}
+
+/* Check synthesized data is finite and within [-1, 1]. With clip,
+ * fix it (warning once), otherwise complain. Returns nonzero if the
+ * data is bad and clip is off. */
+int
+check_output(float *sf_output, size_t length, int clip, int *have_warned) {
+  if (clip) {
+    for (int i = 0; i < length; i++) {
+      if (!finite(sf_output[i])) {
+	if (!*have_warned) {
+	  *have_warned = 1;
+	  fprintf(stderr,
+		  "%s: Warning: clipping NaN or Inf in synthesized data\n",
+		  my_name);
+	}
+	if (sf_output[i] < 0.0f) {
+	  sf_output[i] = -1.0f;
+	} else {
+	  sf_output[i] = 1.0f;
+	}
+      } else {
+	if (sf_output[i] < -1.0f) {
+	  if (!*have_warned) {
+	    *have_warned = 1;
+	    fprintf(stderr,
+		    "%s: Warning: clipping out-of-bounds value in synthesized data\n",
+		    my_name);
+	  }
+	  sf_output[i] = -1.0f;
+	} else if (sf_output[i] > 1.0f) {
+	  if (!*have_warned) {
+	    *have_warned = 1;
+	    fprintf(stderr,
+		    "%s: Warning: clipping out-of-bounds value in synthesized data\n",
+		    my_name);
+	  }
+	  sf_output[i] = 1.0f;
+	}
+      }
+    }
+  } else {
+    for (int i = 0; i < length; i++) {
+      if (!finite(sf_output[i])) {
+	fprintf(stderr, "%s: Error: NaN or Inf in synthesized data\n",
+		my_name);
+	return 1;
+      }
+      if (sf_output[i] > 1.0f
+	  || sf_output[i] < -1.0f) {
+	fprintf(stderr, "%s: Error: sample data out of bounds\n",
+		my_name);
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* JSON output for --describe */
+void
+json_string(FILE *fp, const char *s) {
+  if (!s) {
+    fputs("null", fp);
+    return;
+  }
+  fputc('"', fp);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(fp, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(fp, "\\u%04x", c);
+    } else {
+      fputc(c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+void
+json_number(FILE *fp, double x) {
+  if (isfinite(x)) {
+    fprintf(fp, "%.9g", x);
+  } else {
+    fputs("null", fp);
+  }
+}
+
+const char *
+json_bool(int x) {
+  return x ? "true" : "false";
+}
+
+/* Insert "-<tag>" before the output file's extension, eg
+ * output.wav -> output-000042.wav, replacing the extension with ext if
+ * it's not NULL */
+void
+make_output_name(char *buf, size_t size, const char *file, const char *tag,
+		 const char *ext) {
+  const char *slash = strrchr(file, '/');
+  const char *dot = strrchr(file, '.');
+
+  if (!dot || (slash && dot < slash)) {
+    dot = file + strlen(file);
+  }
+  snprintf(buf, size, "%.*s-%s%s", (int) (dot - file), file, tag,
+	   ext ? ext : dot);
+}
+
+/* Where render() puts its interleaved output. With nbuffers == 0 each
+ * block is written with sf_writef_float() as soon as it's ready.
+ * Otherwise blocks are collected into a fixed pool of buffers which a
+ * writer thread encodes and writes, so that disk I/O overlaps with
+ * the plugin's run_synth(), and memory use doesn't depend on how long
+ * the render is. An output_t starts zeroed and is kept with its
+ * instance: the writer thread is started by the first output_open(),
+ * idles between renders, and is stopped by output_destroy(). */
+typedef struct {
+  SNDFILE *outfile;
+  int nchannels;
+  size_t nframes;        /* frames per block */
+  size_t buffer_frames;  /* frames per buffer: a multiple of nframes */
+  int nbuffers;
+  float *pool;           /* max(nbuffers, 1) buffers */
+  size_t *used;          /* frames used in each buffer */
+  int head;              /* next buffer for the writer thread */
+  int tail;              /* buffer being filled by render() */
+  int count;             /* buffers waiting for the writer thread */
+  int finishing;          /* set by output_close(), cleared when done */
+  int error;
+  int started;
+  int quit;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;  /* a buffer was queued, or finishing or quit set */
+  pthread_cond_t space;  /* a buffer was written, or finishing cleared */
+  pthread_t thread;
+} output_t;
+
+void *
+output_writer(void *arg) {
+  output_t *o = arg;
+
+  pthread_mutex_lock(&o->lock);
+  for (;;) {
+    while (!o->count && !o->finishing && !o->quit) {
+      pthread_cond_wait(&o->ready, &o->lock);
+    }
+    if (o->quit) {
+      break;
+    }
+    if (!o->count) {
+      /* All written: idle until the next render */
+      o->finishing = 0;
+      pthread_cond_signal(&o->space);
+      continue;
+    }
+    float *buffer = o->pool + o->head * o->buffer_frames * o->nchannels;
+    size_t frames = o->used[o->head];
+    pthread_mutex_unlock(&o->lock);
+
+    /* The render thread never touches a queued buffer, so we can write
+     * without holding the lock */
+    int failed = (sf_writef_float(o->outfile, buffer, frames) != frames);
+
+    pthread_mutex_lock(&o->lock);
+    if (failed) {
+      o->error = 1;
+    }
+    o->head = (o->head + 1) % o->nbuffers;
+    o->count--;
+    pthread_cond_signal(&o->space);
+  }
+  pthread_mutex_unlock(&o->lock);
+  return NULL;
+}
+
+/* The pool comes from arena, and lasts until it is reset */
+void
+output_open(output_t *o, arena_t *arena, SNDFILE *outfile, int nchannels,
+	    size_t nframes, int nbuffers) {
+  if (nbuffers && !o->started) {
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->ready, NULL);
+    pthread_cond_init(&o->space, NULL);
+    pthread_create(&o->thread, NULL, output_writer, o);
+    o->started = 1;
+  }
+
+  /* (the writer thread is idle, but may wake up to look) */
+  if (o->started) {
+    pthread_mutex_lock(&o->lock);
+  }
+  o->outfile = outfile;
+  o->nchannels = nchannels;
+  o->nframes = nframes;
+  o->nbuffers = nbuffers;
+  o->buffer_frames = nbuffers ?
+    nframes * ((WRITER_BUFFER_FRAMES + nframes - 1) / nframes) : nframes;
+  o->pool = arena_alloc(arena, (nbuffers ? nbuffers : 1) *
+			o->buffer_frames * nchannels * sizeof(float));
+  o->used = arena_alloc(arena, (nbuffers ? nbuffers : 1) * sizeof(size_t));
+  o->head = o->tail = o->count = 0;
+  o->finishing = o->error = 0;
+  if (o->started) {
+    pthread_mutex_unlock(&o->lock);
+  }
+}
+
+/* Where the next nframes interleaved frames should go */
+float *
+output_block(output_t *o) {
+  return o->pool + (o->tail * o->buffer_frames + o->used[o->tail])
+    * o->nchannels;
+}
+
+/* Write (or queue) the block filled in since output_block(). Returns
+ * nonzero if writing has failed. */
+int
+output_commit(output_t *o) {
+  if (!o->nbuffers) {
+    if (sf_writef_float(o->outfile, o->pool, o->nframes) != o->nframes) {
+      o->error = 1;
+    }
+    return o->error;
+  }
+
+  o->used[o->tail] += o->nframes;
+  if (o->used[o->tail] < o->buffer_frames) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&o->lock);
+  o->count++;
+  pthread_cond_signal(&o->ready);
+  while (o->count == o->nbuffers) {
+    pthread_cond_wait(&o->space, &o->lock);
+  }
+  o->tail = (o->tail + 1) % o->nbuffers;
+  o->used[o->tail] = 0;
+  int error = o->error;
+  pthread_mutex_unlock(&o->lock);
+  return error;
+}
+
+/* Flush anything queued and wait for the writer thread to finish
+ * with this file. Returns nonzero if any write failed. */
+int
+output_close(output_t *o) {
+  int error = 0;
+
+  if (o->nbuffers) {
+    pthread_mutex_lock(&o->lock);
+    if (o->used[o->tail]) {
+      o->count++;
+    }
+    o->finishing = 1;
+    pthread_cond_signal(&o->ready);
+    while (o->finishing) {
+      pthread_cond_wait(&o->space, &o->lock);
+    }
+    error = o->error;
+    pthread_mutex_unlock(&o->lock);
+  }
+
+  return error;
+}
+
+/* Stop the writer thread, after the last output_close() */
+void
+output_destroy(output_t *o) {
+  if (o->started) {
+    pthread_mutex_lock(&o->lock);
+    o->quit = 1;
+    pthread_cond_signal(&o->ready);
+    pthread_mutex_unlock(&o->lock);
+
+    pthread_join(o->thread, NULL);
+    pthread_mutex_destroy(&o->lock);
+    pthread_cond_destroy(&o->ready);
+    pthread_cond_destroy(&o->space);
+    o->started = 0;
+  }
+}
+
+/* Audio for the plugin's audio input ports, read from a file (or
+ * stdin) by a reader thread into a small ring of buffers, so that
+ * render() never waits for the disk unless the reader falls behind.
+ * Files ending in .raw are native-endian interleaved floats with one
+ * channel per input port; they are mmap()ed rather than going through
+ * libsndfile. Like output_t, an input_t starts zeroed and is kept with
+ * its instance, and so is its reader thread, until input_destroy(). */
+typedef struct {
+  SNDFILE *infile;
+  int raw;
+  float *map;            /* .raw files */
+  size_t map_bytes;
+  size_t map_frames;
+  size_t map_pos;
+  int nchannels;
+  size_t buffer_frames;
+  int nbuffers;
+  float *pool;
+  size_t *used;          /* frames in each buffer; short at end of file */
+  int head;              /* buffer being read by render() */
+  size_t pos;            /* frame within the head buffer */
+  int tail;              /* next buffer for the reader thread */
+  int count;             /* buffers filled and not yet used up */
+  int eof;               /* the reader thread has queued its last buffer */
+  int stopping;
+  int running;           /* the reader thread is busy with this input */
+  int started;
+  int quit;
+  pthread_mutex_t lock;
+  pthread_cond_t filled; /* a buffer was filled, or running cleared */
+  pthread_cond_t space;  /* a buffer was used, or running, stopping or
+			    quit set */
+  pthread_t thread;
+} input_t;
+
+size_t
+input_fill(input_t *in, float *buffer) {
+  if (in->raw) {
+    size_t frames = in->map_frames - in->map_pos;
+    if (frames > in->buffer_frames) {
+      frames = in->buffer_frames;
+    }
+    if (frames) {
+      memcpy(buffer, in->map + in->map_pos * in->nchannels,
+	     frames * in->nchannels * sizeof(float));
+    }
+    in->map_pos += frames;
+    return frames;
+  }
+
+  sf_count_t frames = sf_readf_float(in->infile, buffer, in->buffer_frames);
+  return (frames > 0) ? frames : 0;
+}
+
+void *
+input_reader(void *arg) {
+  input_t *in = arg;
+
+  pthread_mutex_lock(&in->lock);
+  for (;;) {
+    while (!in->running && !in->quit) {
+      pthread_cond_wait(&in->space, &in->lock);
+    }
+    if (in->quit) {
+      break;
+    }
+    while (in->count == in->nbuffers && !in->stopping) {
+      pthread_cond_wait(&in->space, &in->lock);
+    }
+    if (in->eof || in->stopping) {
+      /* Done with this input: idle until the next one */
+      in->running = 0;
+      pthread_cond_signal(&in->filled);
+      continue;
+    }
+    float *buffer = in->pool + in->tail * in->buffer_frames * in->nchannels;
+    pthread_mutex_unlock(&in->lock);
+
+    size_t frames = input_fill(in, buffer);
+
+    pthread_mutex_lock(&in->lock);
+    in->used[in->tail] = frames;
+    in->tail = (in->tail + 1) % in->nbuffers;
+    in->count++;
+    if (frames < in->buffer_frames) {
+      in->eof = 1;
+    }
+    pthread_cond_signal(&in->filled);
+  }
+  pthread_mutex_unlock(&in->lock);
+  return NULL;
+}
+
+/* Open the input ("-" for stdin) and start reading ahead, with
+ * buffers from arena. Returns 0 on success. */
+int
+input_open(input_t *in, arena_t *arena, const char *file, int ins) {
+  size_t len = strlen(file);
+  SF_INFO insfinfo;
+
+  /* (the reader thread, if any, is idle and leaves these alone) */
+  in->infile = NULL;
+  in->raw = 0;
+  in->map = NULL;
+  in->map_pos = 0;
+
+  if (len > 4 && !strcmp(file + len - 4, ".raw")) {
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "%s: Error: Not able to open input file %s.\n",
+	      my_name, file);
+      if (fd >= 0) close(fd);
+      return 1;
+    }
+    in->raw = 1;
+    in->nchannels = ins;
+    in->map_bytes = st.st_size;
+    in->map_frames = st.st_size / (ins * sizeof(float));
+    if (in->map_bytes) {
+      in->map = mmap(NULL, in->map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (in->map == MAP_FAILED) {
+      fprintf(stderr, "%s: Error: Not able to map input file %s.\n",
+	      my_name, file);
+      return 1;
+    }
+    if (in->map) {
+      madvise(in->map, in->map_bytes, MADV_SEQUENTIAL);
+    }
+  } else {
+    memset(&insfinfo, 0, sizeof(insfinfo));
+    if (!strcmp(file, "-")) {
+      in->infile = sf_open_fd(0, SFM_READ, &insfinfo, 0);
+    } else {
+      in->infile = sf_open(file, SFM_READ, &insfinfo);
+    }
+    if (!in->infile) {
+      fprintf(stderr, "%s: Error: Not able to open input file %s.\n",
+	      my_name, file);
+      fprintf(stderr, "%s: %s\n", my_name, sf_strerror(NULL));
+      return 1;
+    }
+    if (insfinfo.samplerate != (int) sample_rate) {
+      fprintf(stderr, "%s: Warning: input file %s is at %d Hz, "
+	      "not resampling to %d Hz\n",
+	      my_name, file, insfinfo.samplerate, (int) sample_rate);
+    }
+    in->nchannels = insfinfo.channels;
+  }
+
+  in->buffer_frames = READER_BUFFER_FRAMES;
+  in->nbuffers = READER_BUFFERS;
+  in->pool = arena_alloc(arena, in->nbuffers * in->buffer_frames *
+			 in->nchannels * sizeof(float));
+  in->used = arena_alloc(arena, in->nbuffers * sizeof(size_t));
+
+  if (!in->started) {
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->filled, NULL);
+    pthread_cond_init(&in->space, NULL);
+    pthread_create(&in->thread, NULL, input_reader, in);
+    in->started = 1;
+  }
+
+  pthread_mutex_lock(&in->lock);
+  in->head = in->tail = in->count = 0;
+  in->pos = 0;
+  in->eof = in->stopping = 0;
+  in->running = 1;
+  pthread_cond_signal(&in->space);
+  pthread_mutex_unlock(&in->lock);
+  return 0;
+}
+
+/* Fill the plugin's input buffers with the next nframes frames. Input
+ * channel i goes to input port i; if there are fewer channels than
+ * ports, the last channel is repeated. After the end of the input the
+ * buffers are filled with silence. Returns the number of frames of
+ * real input. */
+size_t
+input_read(input_t *in, float **bufs, int ins, size_t nframes) {
+  size_t done = 0;
+
+  while (done < nframes) {
+    pthread_mutex_lock(&in->lock);
+    while (!in->count && !in->eof) {
+      pthread_cond_wait(&in->filled, &in->lock);
+    }
+    int count = in->count;
+    pthread_mutex_unlock(&in->lock);
+    if (!count) {
+      break;
+    }
+
+    /* The reader thread leaves the head buffer alone until we let it
+     * go, so there's no need to hold the lock while copying */
+    const float *buffer = in->pool + in->head * in->buffer_frames * in->nchannels;
+    size_t n = in->used[in->head] - in->pos;
+    if (n > nframes - done) {
+      n = nframes - done;
+    }
+    for (int p = 0; p < ins; p++) {
+      int channel = min(p, in->nchannels - 1);
+      for (size_t i = 0; i < n; i++) {
+	bufs[p][done + i] = buffer[(in->pos + i) * in->nchannels + channel];
+      }
+    }
+    in->pos += n;
+    done += n;
+
+    if (in->pos == in->used[in->head]) {
+      pthread_mutex_lock(&in->lock);
+      in->head = (in->head + 1) % in->nbuffers;
+      in->pos = 0;
+      in->count--;
+      pthread_cond_signal(&in->space);
+      pthread_mutex_unlock(&in->lock);
+    }
+  }
+
+  for (int p = 0; p < ins; p++) {
+    memset(bufs[p] + done, 0, (nframes - done) * sizeof(float));
+  }
+  return done;
+}
+
+/* Wait for the reader thread to let go of the input, and close it */
+void
+input_close(input_t *in) {
+  pthread_mutex_lock(&in->lock);
+  in->stopping = 1;
+  pthread_cond_signal(&in->space);
+  while (in->running) {
+    pthread_cond_wait(&in->filled, &in->lock);
+  }
+  pthread_mutex_unlock(&in->lock);
+
+  if (in->infile) {
+    sf_close(in->infile);
+  } else if (in->map) {
+    munmap(in->map, in->map_bytes);
+  }
+}
+
+/* Stop the reader thread, after the last input_close() */
+void
+input_destroy(input_t *in) {
+  if (in->started) {
+    pthread_mutex_lock(&in->lock);
+    in->quit = 1;
+    pthread_cond_signal(&in->space);
+    pthread_mutex_unlock(&in->lock);
+
+    pthread_join(in->thread, NULL);
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->filled);
+    pthread_cond_destroy(&in->space);
+    in->started = 0;
+  }
+}
+
 typedef enum {
   from_stdin,
   from_defaults,
@@ -286,5 +1429,50 @@ typedef enum {
   from_random
 } port_vals_source_t;
 
+/* An output file, and how the plugin's outputs are mixed into it */
+typedef struct {
+  const char *file;
+  const char *matrix;  /* NULL for the -c channel layout */
+  routing_t routing;
+} output_spec_t;
+
+/* Options which apply to every note we render */
+typedef struct {
+  size_t length;
+  size_t release_tail;
+  size_t nframes;
+  int nchannels;
+  int midi_note;
+  int midi_velocity;
+  int clip;
+  int flush_denormals;
+  int time_blocks;
+  int nbuffers;
+  const char *input_file;
+  output_spec_t *outputs;
+  int noutputs;
+  char *projectDirectory;
+  char **configure_key;
+  char **configure_val;
+  int nkeys;
+} render_opts_t;
+
+/* A plugin instance and the buffers connected to its ports */
+typedef struct {
+  const DSSI_Descriptor *descriptor;
+  LADSPA_Handle handle;
+  int ins, outs, controlIns, controlOuts;
+  float **pluginInputBuffers, **pluginOutputBuffers;
+  float *pluginControlIns, *pluginControlOuts;
+  int configured;
+  block_stats_t block_stats;
+  arena_t arena;        /* the port buffers, for the instance's lifetime */
+  arena_t job_arena;    /* reset by every render() */
+  size_t frames_written;  /* by the last render() */
+  output_t *output;     /* render()'s, with their writer threads */
+  int noutputs;
+  input_t input;        /* and its -i input, with its reader thread */
+} instance_t;
+
 #endif /* _CLI_DSSI_HOST_H */
 
@@ -0,0 +1,276 @@
+#!/bin/sh
+# run-tests.sh: the "make check" suite for cli-dssi-host.
+#
+# Renders known scenarios with the plugins in test-plugins.so and
+# compares the results with the files in tests/golden, checks how
+# release tails end (by silence, by -r, by the end of an -i input, and
+# by truncation at MAX_LENGTH), checks that batches stop allocating
+# after the first render, and fails if rendering is slower than
+# MIN_FRAMES_PER_SEC.
+#
+# Run from the top build directory, normally by "make check".
+#   UPDATE_GOLDEN=1     rewrite the golden files instead of comparing
+#                       (listen to them before committing!)
+#   MIN_FRAMES_PER_SEC  throughput floor (default 1000000, about 20x
+#                       real time; set it to 0 under valgrind etc.)
+
+srcdir=${srcdir:-.}
+HOST=${HOST:-./src/cli-dssi-host}
+WAVCMP=${WAVCMP:-./tests/wavcmp}
+GOLDEN=$srcdir/tests/golden
+OUT=tests/out
+MIN_FRAMES_PER_SEC=${MIN_FRAMES_PER_SEC:-1000000}
+SAMPLE_RATE=44100
+BLOCK=256
+
+# The host only looks for relative library names on DSSI_PATH, which
+# must be absolute
+DSSI_PATH=`cd tests && pwd`
+export DSSI_PATH
+LIB=test-plugins.so
+
+rm -rf $OUT
+mkdir -p $OUT
+
+npass=0
+nfail=0
+
+pass () {
+  echo "PASS: $1"
+  npass=`expr $npass + 1`
+}
+
+fail () {
+  echo "FAIL: $1"
+  shift
+  for line in "$@"; do
+    echo "  $line"
+  done
+  nfail=`expr $nfail + 1`
+}
+
+# host <name> <args...>: render, keeping stdout and stderr for later
+host () {
+  name=$1
+  shift
+  $HOST "$@" > $OUT/$name.log 2>&1
+}
+
+# golden <name> <lsbs> <file> [<test>]: compare <file> with
+# golden/<name>.wav
+golden () {
+  if test -n "$UPDATE_GOLDEN"; then
+    cp $3 $GOLDEN/$1.wav
+    echo "UPDATED: $1"
+  elif msg=`$WAVCMP -t $2 $GOLDEN/$1.wav $3 2>&1`; then
+    pass "${4:-$1}"
+  else
+    fail "${4:-$1}" "$msg"
+  fi
+}
+
+# frames <name> <expected> <log>: check the frame count the host reports
+frames () {
+  written=`sed -n 's/.*: Wrote \([0-9]*\) frames to .*/\1/p' $3 | head -n 1`
+  if test "$written" = "$2"; then
+    pass "$1"
+  else
+    fail "$1" "wrote ${written:-no} frames, expected $2"
+  fi
+}
+
+# first_block_after <seconds>: frames written by the time the host sees
+# it has gone past <seconds> (it only checks at the end of each block)
+first_block_after () {
+  awk "BEGIN { print (int($1 * $SAMPLE_RATE / $BLOCK) + 1) * $BLOCK }"
+}
+
+
+# Sine with the default frequency, waiting for the release to die away
+host sine $LIB:test_sine -p -1 -l 0.2 -f $OUT/sine.wav
+golden sine 1 $OUT/sine.wav
+
+# Frequency from stdin, fixed release tail
+echo 1000 | host sine-stdin $LIB:test_sine -l 0.1 -r 0.05 -f $OUT/sine-stdin.wav
+golden sine-stdin 1 $OUT/sine-stdin.wav
+frames sine-stdin-length `first_block_after 0.15` $OUT/sine-stdin.log
+
+# Noise is all integer arithmetic, so it must be bit-exact
+host noise $LIB:test_noise -p -1 -l 0.1 -f $OUT/noise.wav
+golden noise 0 $OUT/noise.wav
+
+# Four outputs: all of them, and a stereo mixdown from the same render
+host multi $LIB:test_multi -p -1 -l 0.05 -c -1 -f $OUT/multi.wav \
+  -x $OUT/multi-mix.wav=1,0,0.5,0.5/0,1,0.5,0.5
+golden multi 1 $OUT/multi.wav
+golden multi-mix 1 $OUT/multi-mix.wav
+
+# The writer thread mustn't change anything
+host multi-w $LIB:test_multi -p -1 -l 0.05 -c -1 -w 2 -f $OUT/multi-w.wav
+golden multi 0 $OUT/multi-w.wav multi-writer-thread
+
+# A NaN is an error, and leaves no output file, unless -b clips it
+if host nan $LIB:test_nan -p -1 -l 0.1 -f $OUT/nan.wav; then
+  fail nan-error "NaN in the output was accepted"
+elif test -f $OUT/nan.wav; then
+  fail nan-error "$OUT/nan.wav was left behind"
+else
+  pass nan-error
+fi
+host nan-clipped $LIB:test_nan -p -1 -l 0.1 -b -f $OUT/nan-clipped.wav
+golden nan-clipped 1 $OUT/nan-clipped.wav
+
+# A plugin which never goes silent is truncated at MAX_LENGTH ...
+max_length=`sed -n 's/^#define MAX_LENGTH (\([0-9.]*\)f*).*/\1/p' \
+  $srcdir/src/cli-dssi-host.h`
+host drone $LIB:test_drone -p -1 -f $OUT/drone.wav
+frames drone-truncated `first_block_after $max_length` $OUT/drone.log
+if grep "truncating" $OUT/drone.log > /dev/null; then
+  pass drone-warning
+else
+  fail drone-warning "no truncation warning"
+fi
+
+# ... but not if -r says how long the tail is
+host drone-r $LIB:test_drone -p -1 -r 0.5 -f $OUT/drone-r.wav
+frames drone-release `first_block_after 1.5` $OUT/drone-r.log
+
+# An effect, fed from a file
+host gain $LIB:test_gain -p -1 -i $GOLDEN/sine.wav -f $OUT/gain.wav
+golden gain 1 $OUT/gain.wav
+
+# Every program, each fed the same input; stdin can't be shared out
+host gain-all $LIB:test_gain -p all -j 2 -i $GOLDEN/sine.wav \
+  -f $OUT/gain-all.wav
+golden gain 0 $OUT/gain-all-000-000-Half.wav gain-all
+host gain-all-stdin $LIB:test_gain -p all -i - -f $OUT/gain-stdin.wav \
+  < $GOLDEN/sine.wav
+if ls $OUT/gain-stdin-* > /dev/null 2>&1; then
+  fail gain-all-stdin "-p all read the input from stdin"
+else
+  pass gain-all-stdin
+fi
+
+# MAX_LENGTH counts from the end of the input, not from -l, so an input
+# longer than that runs to its end and on to silence
+long=`awk "BEGIN { print $max_length + 2 }"`
+host long-source $LIB:test_sine -p -1 -l $long -r 0 -f $OUT/long-source.wav
+host long-input $LIB:test_gain -p -1 -l 0.5 -i $OUT/long-source.wav \
+  -f $OUT/long-input.wav
+source_frames=`sed -n 's/.*: Wrote \([0-9]*\) frames to .*/\1/p' \
+  $OUT/long-source.log`
+written=`sed -n 's/.*: Wrote \([0-9]*\) frames to .*/\1/p' $OUT/long-input.log`
+if grep "truncating" $OUT/long-input.log > /dev/null; then
+  fail long-input "truncated after ${written:-no} frames"
+elif test "${written:-0}" -lt "${source_frames:-1}"; then
+  fail long-input "wrote ${written:-no} frames of a $source_frames-frame input"
+else
+  pass long-input
+fi
+
+# --describe fails, printing nothing, on a label the library doesn't have
+if host describe-typo $LIB:test_sien --describe; then
+  fail describe-typo "unknown label accepted"
+elif grep "\"plugins\"" $OUT/describe-typo.log > /dev/null; then
+  fail describe-typo "printed a description anyway"
+else
+  pass describe-typo
+fi
+
+# Random patch n is the same in any batch and on any thread
+host batch $LIB:test_sine -s 7 -N 4 -j 2 -l 0.05 -f $OUT/batch.wav
+host batch-one $LIB:test_sine -s 7 -N 2:1 -l 0.05 -f $OUT/one.wav
+if msg=`$WAVCMP $OUT/batch-000002.wav $OUT/one-000002.wav 2>&1` &&
+   cmp $OUT/batch-000002.prs $OUT/one-000002.prs > /dev/null; then
+  pass batch-reproducible
+else
+  fail batch-reproducible "$msg"
+fi
+
+# Random values for a port hinted as a fraction of the sample rate are
+# kept, not "repaired" back to the default
+host batch-sr $LIB:test_sine_sr -s 9 -N 2 -l 0.05 -f $OUT/sr.wav
+if grep "overriding" $OUT/batch-sr.log > /dev/null; then
+  fail batch-sr-random "`grep overriding $OUT/batch-sr.log | head -n 1`"
+elif cmp $OUT/sr-000000.prs $OUT/sr-000001.prs > /dev/null; then
+  fail batch-sr-random "patches 0 and 1 are the same"
+else
+  pass batch-sr-random
+fi
+
+# Pinning the workers changes nothing, and each node reports its share
+# of the renders; without libnuma, -A falls back to plain threads
+host batch-affinity $LIB:test_sine -s 7 -N 4 -j 2 -A -l 0.05 \
+  -f $OUT/affinity.wav
+node_renders=`sed -n 's/.*: node [0-9]*: [0-9]* workers, \([0-9]*\) renders.*/\1/p' \
+  $OUT/batch-affinity.log | awk '{ n += $1 } END { print n + 0 }'`
+if { ldconfig -p || /sbin/ldconfig -p; } 2>/dev/null |
+   grep "libnuma\.so\.1 " > /dev/null; then
+  have_numa=yes
+else
+  have_numa=
+fi
+if ! msg=`$WAVCMP $OUT/batch-000003.wav $OUT/affinity-000003.wav 2>&1`; then
+  fail batch-affinity "$msg"
+elif test -n "$have_numa"; then
+  if grep "Warning" $OUT/batch-affinity.log > /dev/null; then
+    fail batch-affinity "`grep Warning $OUT/batch-affinity.log`"
+  elif test "$node_renders" -ne 4 ||
+       ! grep "all nodes: 2 workers, 4 renders" $OUT/batch-affinity.log \
+         > /dev/null; then
+    fail batch-affinity "per-node reports add up to $node_renders renders of 4"
+  else
+    pass batch-affinity
+  fi
+elif grep -e "-A is ignored" $OUT/batch-affinity.log > /dev/null; then
+  pass "batch-affinity (no libnuma, so not pinned)"
+else
+  fail batch-affinity "no libnuma, but no fallback warning"
+fi
+
+# -A means nothing for a single render, so it says so
+host affinity-single $LIB:test_sine -p -1 -l 0.05 -A -f $OUT/single.wav
+if grep "only applies to -N and -p all" $OUT/affinity-single.log > /dev/null
+then
+  pass affinity-single
+else
+  fail affinity-single "-A ignored silently"
+fi
+
+# steady_state <name>: after the first render on a thread, the host
+# allocates nothing while rendering, and the same (nothing, so far)
+# each time it sets up
+steady_state () {
+  counts=`sed -n 's/.* allocations: \([0-9]*\) setting up, \([0-9]*\) while rendering$/\1 \2/p' \
+    $OUT/$1.log | tail -n 2 | tr '\n' ' '`
+  set -- $1 $counts
+  if test $# -ne 5; then
+    fail $1 "no allocation counts"
+  elif test $5 -ne 0 || test $2 -ne $4; then
+    fail $1 "$4 setting up (then $2 before), $5 while rendering"
+  else
+    pass "$1 ($4 setting up)"
+  fi
+}
+host steady-state-allocations $LIB:test_multi -s 7 -N 3 -j 1 -l 0.05 \
+  -c -1 -T -w 2 -f $OUT/alloc.wav -x $OUT/alloc-mix.wav=1,1
+steady_state steady-state-allocations
+host steady-state-input $LIB:test_gain -s 7 -N 3 -j 1 -T -w 2 \
+  -i $GOLDEN/sine.wav -f $OUT/alloc-input.wav
+steady_state steady-state-input
+
+# Throughput floor, on a long mono render
+host throughput $LIB:test_sine -p -1 -l 30 -r 0 -T -f $OUT/throughput.wav
+rate=`sed -n 's/.*frames in .* s, \([0-9]*\) frames\/s/\1/p' \
+  $OUT/throughput.log`
+if test -z "$rate"; then
+  fail throughput "no timing in $OUT/throughput.log"
+elif test "$rate" -lt "$MIN_FRAMES_PER_SEC"; then
+  fail throughput "$rate frames/s, below the floor of $MIN_FRAMES_PER_SEC"
+else
+  pass "throughput ($rate frames/s)"
+fi
+
+
+echo "$npass passed, $nfail failed"
+test $nfail -eq 0
@@ -0,0 +1,309 @@
+/* test-plugins.c
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307
+ * USA
+ */
+
+/* Tiny DSSI plugins for "make check". Everything they do is decided
+ * by the frame count and the note-on/note-off events, and everything
+ * is reset in activate(), so a given command line always renders the
+ * same audio.
+ *
+ *   test_sine   sine at the Frequency port, 0.1s linear release
+ *   test_noise  white noise from a fixed-seed LCG while the note is on
+ *   test_nan    sine with a NaN at frame 1000
+ *   test_drone  constant output which ignores note-off (never silent)
+ *   test_multi  four sawtooth outputs, at different pitches and levels
+ *   test_gain   an effect: its audio input times the Gain port, with a
+ *               feedback echo so that it has a tail after the input ends;
+ *               programs 0:0 "Half" and 0:1 "Quarter" set the Gain
+ *   test_sine_sr  test_sine, with Frequency hinted as a fraction of the
+ *               sample rate (0.001 .. 0.05, as cutoff ports often are)
+ */
+
+#include <ladspa.h>
+#include <dssi.h>
+#include <alsa/asoundlib.h>
+#include <alsa/seq.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MAX_OUTS 4
+#define RELEASE_SECONDS 0.1
+#define ECHO_FRAMES 64
+
+enum { SINE, NOISE, NAN_AT_1000, DRONE, MULTI, GAIN, SINE_SR, NPLUGINS };
+
+typedef struct {
+  int type;
+  unsigned long sample_rate;
+  LADSPA_Data *out[MAX_OUTS];
+  LADSPA_Data *in;
+  LADSPA_Data *control;       /* Frequency, or Gain for test_gain */
+  unsigned long frame;        /* since activate() */
+  unsigned long release;      /* frames left of the release */
+  int note_on;
+  uint32_t noise;
+  float echo[ECHO_FRAMES];    /* test_gain's last ECHO_FRAMES outputs */
+} test_plugin_t;
+
+static LADSPA_Descriptor ladspa_descriptors[NPLUGINS];
+static DSSI_Descriptor dssi_descriptors[NPLUGINS];
+
+static LADSPA_Handle
+instantiate(const LADSPA_Descriptor *descriptor, unsigned long sample_rate) {
+  test_plugin_t *plugin = calloc(1, sizeof(test_plugin_t));
+
+  if (plugin) {
+    plugin->type = descriptor - ladspa_descriptors;
+    plugin->sample_rate = sample_rate;
+  }
+  return plugin;
+}
+
+static void
+connect_port(LADSPA_Handle handle, unsigned long port, LADSPA_Data *data) {
+  test_plugin_t *plugin = handle;
+
+  /* The control port is always the last; test_gain's input is port 1 */
+  if (port == ladspa_descriptors[plugin->type].PortCount - 1) {
+    plugin->control = data;
+  } else if (plugin->type == GAIN && port == 1) {
+    plugin->in = data;
+  } else {
+    plugin->out[port] = data;
+  }
+}
+
+static void
+activate(LADSPA_Handle handle) {
+  test_plugin_t *plugin = handle;
+
+  plugin->frame = 0;
+  plugin->release = 0;
+  plugin->note_on = 0;
+  plugin->noise = 1;
+  memset(plugin->echo, 0, sizeof(plugin->echo));
+}
+
+/* Envelope for this frame: 1 while the note is on, then a linear
+ * release to exactly 0 */
+static float
+envelope(test_plugin_t *plugin) {
+  unsigned long release_frames = RELEASE_SECONDS * plugin->sample_rate;
+
+  if (plugin->note_on) {
+    return 1.0f;
+  }
+  if (plugin->release) {
+    return (float) plugin->release-- / release_frames;
+  }
+  return 0.0f;
+}
+
+static void
+run_synth(LADSPA_Handle handle, unsigned long nframes,
+	  snd_seq_event_t *events, unsigned long nevents) {
+  test_plugin_t *plugin = handle;
+  unsigned long e = 0;
+
+  for (unsigned long i = 0; i < nframes; i++, plugin->frame++) {
+    for (; e < nevents && events[e].time.tick <= i; e++) {
+      if (events[e].type == SND_SEQ_EVENT_NOTEON &&
+	  events[e].data.note.velocity > 0) {
+	plugin->note_on = 1;
+      } else if (events[e].type == SND_SEQ_EVENT_NOTEON ||
+		 events[e].type == SND_SEQ_EVENT_NOTEOFF) {
+	plugin->note_on = 0;
+	plugin->release = RELEASE_SECONDS * plugin->sample_rate;
+      }
+    }
+
+    /* (in double precision, to keep libm differences below 16 bits) */
+    double phase = 2.0 * M_PI * *plugin->control * plugin->frame /
+      plugin->sample_rate;
+
+    switch (plugin->type) {
+    case SINE:
+    case SINE_SR:
+      plugin->out[0][i] = 0.5f * envelope(plugin) * (float) sin(phase);
+      break;
+    case NOISE:
+      plugin->noise = plugin->noise * 1664525u + 1013904223u;
+      plugin->out[0][i] = plugin->note_on ?
+	(float) (plugin->noise >> 8) / 16777216.0f - 0.5f : 0.0f;
+      break;
+    case NAN_AT_1000:
+      plugin->out[0][i] = plugin->frame == 1000 ?
+	NAN : 0.5f * envelope(plugin) * (float) sin(phase);
+      break;
+    case DRONE:
+      plugin->out[0][i] = 0.25f;
+      break;
+    case MULTI:
+      {
+	float env = envelope(plugin);
+	for (int k = 0; k < MAX_OUTS; k++) {
+	  unsigned long period = 64 >> k;
+	  plugin->out[k][i] = env * (0.2f * (k + 1)) *
+	    ((float) (plugin->frame % period) / period - 0.5f);
+	}
+      }
+      break;
+    case GAIN:
+      {
+	float *echo = &plugin->echo[plugin->frame % ECHO_FRAMES];
+	*echo = *plugin->control * plugin->in[i] + 0.5f * *echo;
+	plugin->out[0][i] = *echo;
+      }
+      break;
+    }
+  }
+}
+
+static const DSSI_Program_Descriptor gain_programs[] = {
+  { 0, 0, "Half" },
+  { 0, 1, "Quarter" }
+};
+static const float gain_program_gains[] = { 0.5f, 0.25f };
+#define NGAIN_PROGRAMS (sizeof(gain_programs) / sizeof(gain_programs[0]))
+
+static const DSSI_Program_Descriptor *
+get_program(LADSPA_Handle handle, unsigned long index) {
+  return index < NGAIN_PROGRAMS ? &gain_programs[index] : NULL;
+}
+
+static void
+select_program(LADSPA_Handle handle, unsigned long bank,
+	       unsigned long program) {
+  test_plugin_t *plugin = handle;
+
+  if (bank == 0 && program < NGAIN_PROGRAMS) {
+    *plugin->control = gain_program_gains[program];
+  }
+}
+
+static void
+cleanup(LADSPA_Handle handle) {
+  free(handle);
+}
+
+static LADSPA_PortDescriptor multi_port_descriptors[MAX_OUTS + 1] = {
+  LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+  LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+  LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+  LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+  LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL
+};
+static const char *multi_port_names[MAX_OUTS + 1] = {
+  "Out 1", "Out 2", "Out 3", "Out 4", "Frequency"
+};
+
+static LADSPA_PortDescriptor mono_port_descriptors[2] = {
+  LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+  LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL
+};
+static const char *mono_port_names[2] = { "Out", "Frequency" };
+
+static LADSPA_PortDescriptor gain_port_descriptors[3] = {
+  LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+  LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO,
+  LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL
+};
+static const char *gain_port_names[3] = { "Out", "In", "Gain" };
+
+/* The audio ports have no hints; the mono plugins use the last two */
+static LADSPA_PortRangeHint range_hints[MAX_OUTS + 1];
+static LADSPA_PortRangeHint gain_range_hints[3];
+static LADSPA_PortRangeHint sr_range_hints[2];
+
+const DSSI_Descriptor *
+dssi_descriptor(unsigned long index) {
+  static const char *labels[NPLUGINS] = {
+    "test_sine", "test_noise", "test_nan", "test_drone", "test_multi",
+    "test_gain", "test_sine_sr"
+  };
+  static int initialised = 0;
+
+  if (index >= NPLUGINS) {
+    return NULL;
+  }
+
+  if (!initialised) {
+    /* Frequency: 20Hz .. 2kHz, default 440 */
+    range_hints[MAX_OUTS].HintDescriptor =
+      LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+      LADSPA_HINT_LOGARITHMIC | LADSPA_HINT_DEFAULT_440;
+    range_hints[MAX_OUTS].LowerBound = 20.0f;
+    range_hints[MAX_OUTS].UpperBound = 2000.0f;
+
+    /* Gain: 0 .. 1, default 0.5 */
+    gain_range_hints[2].HintDescriptor =
+      LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+      LADSPA_HINT_DEFAULT_MIDDLE;
+    gain_range_hints[2].LowerBound = 0.0f;
+    gain_range_hints[2].UpperBound = 1.0f;
+
+    /* Frequency as a fraction of the sample rate: 44.1Hz .. 2.2kHz at
+     * 44.1kHz */
+    sr_range_hints[1].HintDescriptor =
+      LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+      LADSPA_HINT_SAMPLE_RATE | LADSPA_HINT_LOGARITHMIC |
+      LADSPA_HINT_DEFAULT_LOW;
+    sr_range_hints[1].LowerBound = 0.001f;
+    sr_range_hints[1].UpperBound = 0.05f;
+
+    for (int i = 0; i < NPLUGINS; i++) {
+      LADSPA_Descriptor *ld = &ladspa_descriptors[i];
+      DSSI_Descriptor *dd = &dssi_descriptors[i];
+      int multi = (i == MULTI);
+      int gain = (i == GAIN);
+
+      ld->UniqueID = 0;
+      ld->Label = labels[i];
+      ld->Properties = LADSPA_PROPERTY_HARD_RT_CAPABLE;
+      ld->Name = labels[i];
+      ld->Maker = "cli-dssi-host test suite";
+      ld->Copyright = "GPL";
+      ld->PortCount = multi ? MAX_OUTS + 1 : gain ? 3 : 2;
+      ld->PortDescriptors = multi ? multi_port_descriptors :
+	gain ? gain_port_descriptors : mono_port_descriptors;
+      ld->PortNames = multi ? multi_port_names :
+	gain ? gain_port_names : mono_port_names;
+      ld->PortRangeHints = multi ? range_hints :
+	gain ? gain_range_hints :
+	i == SINE_SR ? sr_range_hints : range_hints + MAX_OUTS - 1;
+      ld->instantiate = instantiate;
+      ld->connect_port = connect_port;
+      ld->activate = activate;
+      ld->cleanup = cleanup;
+
+      dd->DSSI_API_Version = 1;
+      dd->LADSPA_Plugin = ld;
+      dd->run_synth = run_synth;
+      dd->get_program = gain ? get_program : NULL;
+      dd->select_program = gain ? select_program : NULL;
+    }
+    initialised = 1;
+  }
+
+  return &dssi_descriptors[index];
+}
@@ -0,0 +1,118 @@
+/* wavcmp.c
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307
+ * USA
+ */
+
+/* Compare two sound files for "make check".
+ *
+ * $ wavcmp [-t <lsbs>] <expected> <actual>
+ *
+ * The files must have the same channel count and length, and no two
+ * samples may differ by more than <lsbs> 16-bit steps (default 0, so
+ * bit-exact). Exits 0 if they match, 1 if not, 2 on errors.
+ */
+
+#include <sndfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define CHUNK_FRAMES 4096
+
+char *my_name;
+
+SNDFILE *
+open_file(const char *file, SF_INFO *info) {
+  SNDFILE *sf;
+
+  memset(info, 0, sizeof(SF_INFO));
+  sf = sf_open(file, SFM_READ, info);
+  if (!sf) {
+    fprintf(stderr, "%s: Error: can't open %s: %s\n",
+	    my_name, file, sf_strerror(NULL));
+    exit(2);
+  }
+  return sf;
+}
+
+int
+main(int argc, char **argv) {
+  SF_INFO expected_info, actual_info;
+  SNDFILE *expected, *actual;
+  float *a, *b;
+  double tolerance = 0.0;
+  double worst = 0.0;
+  long frame = 0, worst_frame = 0;
+  sf_count_t n;
+  int i = 1;
+
+  my_name = argv[0];
+
+  if (argc > 2 && !strcmp(argv[1], "-t")) {
+    tolerance = strtod(argv[2], NULL) / 32768.0;
+    i = 3;
+  }
+  if (argc - i != 2) {
+    fprintf(stderr, "Usage: %s [-t <lsbs>] <expected> <actual>\n", my_name);
+    return 2;
+  }
+
+  expected = open_file(argv[i], &expected_info);
+  actual = open_file(argv[i + 1], &actual_info);
+
+  if (expected_info.channels != actual_info.channels) {
+    fprintf(stderr, "%s: %s has %d channels, expected %d\n", my_name,
+	    argv[i + 1], actual_info.channels, expected_info.channels);
+    return 1;
+  }
+  if (expected_info.frames != actual_info.frames) {
+    fprintf(stderr, "%s: %s has %ld frames, expected %ld\n", my_name,
+	    argv[i + 1], (long) actual_info.frames,
+	    (long) expected_info.frames);
+    return 1;
+  }
+
+  a = malloc(CHUNK_FRAMES * expected_info.channels * sizeof(float));
+  b = malloc(CHUNK_FRAMES * expected_info.channels * sizeof(float));
+
+  while ((n = sf_readf_float(expected, a, CHUNK_FRAMES)) > 0) {
+    if (sf_readf_float(actual, b, n) != n) {
+      fprintf(stderr, "%s: Error: can't read %s\n", my_name, argv[i + 1]);
+      return 2;
+    }
+    for (long s = 0; s < n * expected_info.channels; s++) {
+      /* (NaN never compares greater, so count it as the worst) */
+      double diff = fabs((double) a[s] - b[s]);
+      if (!(diff <= worst)) {
+	worst = isnan(diff) ? INFINITY : diff;
+	worst_frame = frame + s / expected_info.channels;
+      }
+    }
+    frame += n;
+  }
+  if (worst > tolerance) {
+    fprintf(stderr, "%s: %s differs from %s by %.1f LSBs at frame %ld\n",
+	    my_name, argv[i + 1], argv[i], worst * 32768.0, worst_frame);
+    return 1;
+  }
+
+  sf_close(expected);
+  sf_close(actual);
+  free(a);
+  free(b);
+  return 0;
+}